@@ -3,8 +3,11 @@
  * By Alexandre Boutrik (@alexandreboutrik)
  *
  */
+#define		_POSIX_C_SOURCE		200809L		/* clock_gettime() */
+
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
 #include <locale.h>
 #include <stdbool.h>
@@ -19,6 +22,14 @@
 #define		FRATA_Y_INITIAL		2
 #define		FRATA_X				16
 
+#define		TICK_MS				10		/* durao de um tick da simulao */
+#define		FRAME_MS			16		/* intervalo mnimo entre dois quadros */
+#define		MAX_TICKS			25		/* ticks processados por fatia, no mximo */
+#define		MAX_EVENTS			64		/* eventos tratados por quadro, no mximo */
+
+#define		ART_W				104		/* tamanho dos sprites das telas */
+#define		ART_H				24
+
 #define		LEFT_ARROW		0x2190
 #define		UP_ARROW		0x2191
 #define		RIGHT_ARROW		0x2192
@@ -53,6 +64,7 @@
 
 #define		ru16		register	uint_fast16_t
 #define		ru8			register	uint_fast8_t
+#define		cu64		const		uint_fast64_t
 #define		cu16		const		uint_fast16_t
 #define		cu8			const		uint_fast8_t
 
@@ -61,7 +73,8 @@
 
 enum Scr {
 	INITIAL = 0,
-	LEVEL, PAUSE, GAMEOVER, SAVESCORE, RANKING, ABOUT
+	LEVEL, PAUSE, GAMEOVER, SAVESCORE, RANKING, ABOUT,
+	NB_SCR
 };
 
 enum Abt {
@@ -69,6 +82,21 @@ enum Abt {
 	PAGE_2
 };
 
+/* Partes do jogo cronometradas no replay */
+enum Sub {
+	SUB_INPUT = 0,
+	SUB_TICK, SUB_DRAW, SUB_RENDER,
+	NB_SUB
+};
+
+/* Partes fixas das telas, desenhadas uma vez s em sprites */
+enum Art {
+	ART_INITIAL = 0,
+	ART_PAUSE, ART_GAMEOVER, ART_RANKING, ART_SAVESCORE,
+	ART_ABOUT_1, ART_ABOUT_2,
+	NB_ART
+};
+
 typedef struct ScEntry {		/* ScEntry = Score Entry */
 
 	u64			 Score;
@@ -123,15 +151,41 @@ typedef struct GameData {
 	u8			 Life;		/* quantidade de vidas */
 	u32			 Level;		/* nvel atual */
 
+	u64			 NextTick;	/* instante (ms) do prximo tick da simulao */
+	u64			 NextFrame;	/* instante (ms) do prximo quadro */
+	bool		 Ticking;	/* se o timer de ticks da termbox est ligado */
+	bool		 Redraw;	/* se h algo novo para desenhar */
+
+	struct tb_sprite*	Art[NB_ART];	/* sprites das partes fixas */
+
+	struct tb_sprite*	Ranking;		/* ltima imagem da tela de ranking */
+	bool				RankingDrawn;	/* se ela ainda vale */
+	bool				RoadDrawn;		/* se a rua est na camada 0 */
+	enum Scr			Drawn;	/* ltima tela desenhada */
+
 	struct tb_event		Event;	/* termbox event */
 
+	FILE*		 Log;		/* registro do input, com --record ou --replay */
+	bool		 Replay;	/* se o input vem do registro */
+	unsigned	 Seed;		/* seed do rand() */
+	u16			 Width;		/* tamanho da tela no registro */
+	u16			 Height;
+	struct tm	 Today;		/* data do registro */
+
+	u64			 Ticks;		/* ticks simulados desde o incio */
+	u64			 Frames;	/* quadros desenhados no replay */
+	u64			 Time[NB_SUB];	/* ns gastos em cada parte no replay */
+	u64			 Start;		/* incio do replay, em ns */
+
+	bool		 Overlay;	/* se as estatsticas da termbox aparecem (F12) */
+
 } GameData;
 
 /*
  * Lista de funes do cdigo
  */
 
-void		 InitScreen(void);
+void		 InitScreen(GameData*);
 void		 Quit(GameData*);
 void		 Error(GameData*, ci32, const char* Func);
 
@@ -144,13 +198,15 @@ void		 HandleKey(GameData*);
 void		 HandleMouse(GameData*);
 void		 HandleInput(GameData*);
 
+u64			 GetTime(void);
+u64			 GetTimeNs(void);
 void		 GetCurrentDate(struct tm*);
 bool		 CompareStruct_Date(struct tm*, struct tm*);
 
 void		 CopyStruct_ScEntry(ScEntry*, ScEntry*);
 
 u16			 CountEntries(FILE*);
-void		 FillEntries(GameData*);
+void		 FillEntries(GameData*, FILE*);
 
 void		 SaveScorePlayer(FILE*, ScEntry);
 
@@ -164,9 +220,14 @@ void		 MoveHoles(GameData*);
 void		 CalculateColision(GameData*);
 void		 GenerateNewHole(GameData*);
 
+void		 UpdateScr_Level(GameData*);
+void		 Tick(GameData*);
+void		 UpdateTimer(GameData*);
+
 void		 PrintLine(cu8, u8, ci16, u16);
 void		 PrintColumn(u8, cu8, ci16, u16);
 void		 PrintHole(u8, cu8, ci16, cu16);
+void		 PrintRect(cu8, cu8, ci16, cu16, cu16);
 void		 PrintDiamond(u16);
 
 void		 DrawStreetLane(void);
@@ -178,38 +239,83 @@ void		 DrawHoles(GameData*);
 
 void		 ChangeScreen(GameData*, enum Scr);
 
-void		 DrawScr_Initial(void);
+void		 DrawArt_Initial(void);
+void		 DrawArt_Pause(void);
+void		 DrawArt_GameOver(void);
+void		 DrawArt_Ranking(void);
+void		 DrawArt_SaveScore(void);
+void		 DrawArt_AboutPage_1(void);
+void		 DrawArt_AboutPage_2(void);
+void		 LoadArt(GameData*);
+
 void		 DrawScr_Level(GameData*);
-void		 DrawScr_Pause(void);
 void		 DrawScr_GameOver(GameData*);
 
 void		 DrawScr_Ranking(GameData*);
-void		 DrawScr_AboutPage_1(void);
-void		 DrawScr_AboutPage_2(void);
+void		 DrawScr_SaveScore(GameData*);
 void		 DrawAbout(GameData*);
 
+void		 InitCache(GameData*);
+
 void		 ClearScreen(void);
 void		 DrawScreen(GameData*);
 
 void		 UpdatePosition(GameData*);
 
-void InitScreen(void) {
+void		 OpenLog(GameData*, int, const char*[]);
+void		 WriteScores(GameData*);
+void		 ReadScores(GameData*);
+void		 RecordEvent(GameData*);
+bool		 ReadEvent(GameData*, u64*);
+void		 ReplayFrame(GameData*);
+void		 Replay(GameData*);
+void		 PrintReport(GameData*);
+
+void		 DrawOverlay(GameData*);
+void		 PrintStats(const struct tb_stats*);
+
+void InitScreen(GameData* Game) {
 
-	if (tb_init() != 0)
-		err(errno, "tb_init");
+	/* O replay desenha sem terminal, com o tamanho da tela registrada */
+	if (Game->Replay) {
+
+		if (tb_init_headless(open("/dev/null", O_WRONLY), Game->Width, Game->Height) != 0)
+			err(errno, "tb_init_headless");
+
+		tb_init_screen(TB_INIT_ALL);
+
+	} else if (tb_init_with(TB_INIT_ALL | TB_INIT_SYNC_OUTPUT | TB_INIT_DROP_FRAMES) != 0)
+		err(errno, "tb_init_with");
+
+	if (Game->Log != NULL && !Game->Replay)
+		fprintf(Game->Log, "frata %u %d %d %d %d %d\n", Game->Seed, tb_width(), tb_height(),
+				Game->Today.tm_mday, Game->Today.tm_mon, Game->Today.tm_year);
 
 	tb_enable_mouse();
 	tb_hide_cursor();
 
+	/* ClearScreen() limpa com fundo preto */
+	tb_set_clear_attributes(TB_DEFAULT, TB_BLACK);
+
 }
 
 void Quit(GameData* Game) {
 
+	struct tb_stats Total;
+
 	if (Game != NULL)
 		FreeData(Game);
 
+	tb_get_stats(NULL, &Total);
 	tb_shutdown();
 
+	if (Game != NULL && Game->Replay)
+		PrintReport(Game);
+
+	/* Os contadores da termbox saem ao fim de toda partida */
+	if (Game != NULL)
+		PrintStats(&Total);
+
 	exit(EXIT_SUCCESS);
 
 }
@@ -252,6 +358,28 @@ bool CompareStruct_Date(struct tm* Date_1, struct tm* Date_2) {
 
 }
 
+/*
+ * Retorna o tempo em ms de um relgio monotnico
+ */
+u64 GetTime(void) {
+
+	return GetTimeNs() / 1000000;
+
+}
+
+/*
+ * O mesmo em ns
+ */
+u64 GetTimeNs(void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (u64) ts.tv_sec * 1000000000 + (u64) ts.tv_nsec;
+
+}
+
 void GetCurrentDate(struct tm* Date) {
 
 	time_t CurrentTime;
@@ -278,7 +406,11 @@ void InitData(GameData *Game) {
 
 	CheckWindowSize(NULL);
 
-	GetCurrentDate(&(Game->Player.Date));
+	/* O replay usa a data em que a partida foi registrada */
+	if (Game->Replay)
+		Game->Player.Date = Game->Today;
+	else
+		GetCurrentDate(&(Game->Player.Date));
 
 	/* Inicializa o score atual como 100 = Lv 1 e 0 buracos gerados */
 	Game->Player.Score		= 100;
@@ -311,8 +443,8 @@ void InitData(GameData *Game) {
 	/* Comea no nvel 1 */
 	Game->Level				= 1;
 
-	/* Seed para o rand() */
-	srand((unsigned) time(NULL));
+	/* O ranking mudou */
+	Game->RankingDrawn		= false;
 
 }
 
@@ -324,6 +456,16 @@ void FreeData(GameData* Game) {
 	if (Game->Scores.File != NULL)
 		fclose(Game->Scores.File);
 
+	if (Game->Log != NULL)
+		fclose(Game->Log);
+
+	ru8 i;
+
+	for (i = 0; i < NB_ART; i++)
+		tb_sprite_free(Game->Art[i]);
+
+	tb_sprite_free(Game->Ranking);
+
 }
 
 void HandleKey(GameData* Game) {
@@ -347,6 +489,28 @@ void HandleKey(GameData* Game) {
 			Game->Event.ch = 't';
 			break;
 
+		case TB_KEY_F12:
+			Game->Overlay = !Game->Overlay;
+			break;
+
+	}
+
+	/* Com o score salvo, s resta sair: (O)K ou (Q)uit */
+	if (Game->Screen == SAVESCORE) {
+
+		switch (Game->Event.ch) {
+
+			case 'o':
+			case 'O':
+			case 'q':
+			case 'Q':
+				Quit(Game);
+				break;
+
+		}
+
+		return;
+
 	}
 
 	switch (Game->Event.ch) {
@@ -441,6 +605,11 @@ void HandleKey(GameData* Game) {
 				break;
 			}
 			if (Game->Screen == GAMEOVER) {
+
+				/* Um replay no salva o score de novo */
+				if (!Game->Replay)
+					SaveScorePlayer(Game->Scores.File, Game->Player);
+
 				ChangeScreen(Game, SAVESCORE);
 				break;
 			}
@@ -495,6 +664,7 @@ void HandleInput(GameData* Game) {
 		case TB_EVENT_RESIZE:
 			tb_resize();
 			CheckWindowSize(Game);
+			InitCache(Game);
 			break;
 
 	}
@@ -533,15 +703,16 @@ u16 CountEntries(FILE* File) {
 }
 
 /*
- * Salva as entradas salvas do arquivo na struct Players
+ * Salva as entradas lidas de File (o arquivo, ou o registro no replay)
+ * na struct Players
  * Tambm calcula os scores (Sc_highest, Sc_today e Sc_last)
  */
-void FillEntries(GameData* Game) {
+void FillEntries(GameData* Game, FILE* File) {
 	
 	ru16 i;
 	for (i = 0; i < Game->Scores.np; i++) {
 
-		fscanf(Game->Scores.File, "%" SCNu64 " %d %d %d", &(Game->Scores.Players[i].Score),
+		fscanf(File, "%" SCNu64 " %d %d %d", &(Game->Scores.Players[i].Score),
 				&(Game->Scores.Players[i].Date.tm_mday),
 				&(Game->Scores.Players[i].Date.tm_mon),
 				&(Game->Scores.Players[i].Date.tm_year));
@@ -602,6 +773,12 @@ void OpenFile(GameData* Game) {
 
 	ru16 n;
 
+	/* O replay l os scores do registro e no mexe no arquivo */
+	if (Game->Replay) {
+		ReadScores(Game);
+		return;
+	}
+
 	CreateIfDoesntExist(Game);
 
 	/* Abre o arquivo para leitura e escrita */
@@ -619,7 +796,11 @@ void OpenFile(GameData* Game) {
 		Error(Game, errno, "malloc");
 
 	/* L o arquivo e salva cada jogador e seu score na struct Players */
-	FillEntries(Game);
+	FillEntries(Game, Game->Scores.File);
+
+	/* O ranking do replay tem que ser o mesmo desta partida */
+	if (Game->Log != NULL)
+		WriteScores(Game);
 
 }
 
@@ -759,14 +940,66 @@ void GenerateNewHole(GameData* Game) {
 
 }
 
+/*
+ * Avana a simulao do nvel em um tick
+ */
+void UpdateScr_Level(GameData* Game) {
+
+	/* Aumenta o Game->Refresh e verifica se est na hora de aumentar o nvel */
+	UpdateLevel(Game);
+
+	/* Move os buracos para a esquerda se Game->Refresh >= 100 */
+	MoveHoles(Game);
+
+	/* Calcula se houve alguma coliso */
+	CalculateColision(Game);
+
+	/* Gera um novo buraco na tela */
+	GenerateNewHole(Game);
+
+}
+
+/*
+ * Um tick da simulao, de TICK_MS ms
+ * S a tela LEVEL possui algo para simular
+ */
+void Tick(GameData* Game) {
+
+	Game->Ticks++;
+
+	if (Game->Screen == LEVEL)
+		UpdateScr_Level(Game);
+
+}
+
+/*
+ * Liga o timer de ticks da termbox somente na tela LEVEL. Nas outras telas
+ * nada se move, ento o jogo dorme at chegar algum input
+ */
+void UpdateTimer(GameData* Game) {
+
+	bool Ticking = (Game->Screen == LEVEL);
+
+	if (Ticking == Game->Ticking)
+		return;
+
+	Game->Ticking = Ticking;
+
+	if (Ticking) {
+		Game->NextTick = GetTime() + TICK_MS;
+		tb_set_tick(TICK_MS);
+	} else
+		tb_set_tick(0);
+
+}
+
 /*
  * Desenha uma linha de algo
  * n  a quantidade de espaos
  */
 void PrintLine(cu8 y, u8 x, ci16 Color, u16 n) {
 
-	for (; n > 0; n--)
-		tb_string(x++, y, TB_WHITE, Color, " ");
+	tb_hline(x, y, n, TB_WHITE, Color, ' ');
 
 }
 
@@ -776,8 +1009,7 @@ void PrintLine(cu8 y, u8 x, ci16 Color, u16 n) {
  */
 void PrintColumn(u8 y, cu8 x, ci16 Color, u16 n){
 
-	for( ; n > 0; n--)
-		tb_string(x, y++, TB_WHITE, Color, " ");
+	tb_vline(x, y, n, TB_WHITE, Color, ' ');
 
 }
 
@@ -786,11 +1018,17 @@ void PrintColumn(u8 y, cu8 x, ci16 Color, u16 n){
  */
 void PrintHole(u8 y, cu8 x, ci16 Color, cu16 n){
 
-	u8 w = (n / 2);
+	PrintRect(y, x, Color, n, n / 2);
 
-	for (; w > 0; y++, w--)
-		PrintLine(y, x, Color, n);
+}
 
+/*
+ * Desenha um retngulo de algo
+ * w e h so a largura e a altura em espaos
+ */
+void PrintRect(cu8 y, cu8 x, ci16 Color, cu16 w, cu16 h) {
+
+	tb_fill_rect(x, y, w, h, TB_WHITE, Color, ' ');
 
 }
 
@@ -877,9 +1115,7 @@ void DrawHoles(GameData* Game) {
 		 */
 		if (Game->Holes[i].x > FRATA_X) {
 
-			PrintLine(Game->Holes[i].y + 3, Game->Holes[i].x, TB_RED, 6);
-			PrintLine(Game->Holes[i].y + 4, Game->Holes[i].x, TB_RED, 6);
-			PrintLine(Game->Holes[i].y + 5, Game->Holes[i].x, TB_RED, 6);
+			PrintRect(Game->Holes[i].y + 3, Game->Holes[i].x, TB_RED, 6, 3);
 
 		}
 
@@ -895,48 +1131,42 @@ void ChangeScreen(GameData* Game, enum Scr NextScreen) {
 	Game->PrevScreen	=	Game->Screen;
 	Game->Screen		=	NextScreen;
 
+	/* Jogar muda o ranking */
+	if (NextScreen == LEVEL)
+		Game->RankingDrawn = false;
+
 }
 
 /*
  * Desenha a tela inicial do jogo ou seja, o menu principal
  */
-void DrawScr_Initial(void) {
+void DrawArt_Initial(void) {
  
 	ru8 j;
 
-	for( j = 20; j < 24; j++)
-		PrintColumn(1, j, TB_CYAN, 9); // coluna de L
+	PrintRect(1, 20, TB_CYAN, 4, 9); // coluna de L
 
-	for( j = 9; j < 11; j++)
-		PrintLine(j, 20, TB_CYAN, 10); // risco baixo L
+	PrintRect(9, 20, TB_CYAN, 10, 2); // risco baixo L
 
-	for( j = 32; j < 35; j++)
-		PrintColumn(5, j, TB_CYAN, 6); //  coluna de E
+	PrintRect(5, 32, TB_CYAN, 3, 6); //  coluna de E
 
 	PrintLine(10, 35, TB_CYAN, 4); // risco em baixo de E
 
-	for( j = 5; j <7; j++)
-		PrintLine(j, 35, TB_CYAN, 4); // risco em cima de E
+	PrintRect(5, 35, TB_CYAN, 4, 2); // risco em cima de E
 
 	PrintLine(8, 35, TB_CYAN, 3); // risco no meio de E
 
-	for( j = 47; j < 51; j++)
-		PrintColumn(1, j, TB_CYAN, 10); // coluna de F
+	PrintRect(1, 47, TB_CYAN, 4, 10); // coluna de F
 
- 	for( j = 1; j < 3; j++)
- 		PrintLine(j, 47, TB_CYAN, 10); // risco cima de F
+ 	PrintRect(1, 47, TB_CYAN, 10, 2); // risco cima de F
 
- 	for( j = 5; j < 7; j++)
- 		PrintLine(j, 47, TB_CYAN, 7); // risco meio de F
+ 	PrintRect(5, 47, TB_CYAN, 7, 2); // risco meio de F
 
- 	for( j = 57; j < 60; j++)
- 		PrintColumn(5, j, TB_CYAN, 6); // coluna maior de R
+ 	PrintRect(5, 57, TB_CYAN, 3, 6); // coluna maior de R
 
- 	for( j = 5; j <7; j++)
- 		PrintLine(j, 60, TB_CYAN, 4); // risco de cima de R
+ 	PrintRect(5, 60, TB_CYAN, 4, 2); // risco de cima de R
 
- 	for( j = 62; j < 65; j++)
- 		PrintColumn(5, j, TB_CYAN, 3); // coluna menor de R
+ 	PrintRect(5, 62, TB_CYAN, 3, 3); // coluna menor de R
 
 	PrintLine(8, 60, TB_CYAN, 5); // baixo - R
 
@@ -944,31 +1174,23 @@ void DrawScr_Initial(void) {
  	PrintLine(10, 63, TB_CYAN, 2);
  	PrintLine(11, 65, TB_CYAN, 2);
 
- 	for( j = 69; j < 72; j++)
- 		PrintColumn(5, j, TB_CYAN, 6); // esquerda - A1
+ 	PrintRect(5, 69, TB_CYAN, 3, 6); // esquerda - A1
 
- 	for( j = 5; j <7; j++)
- 		PrintLine(j, 70, TB_CYAN, 4); // cima - A1
+ 	PrintRect(5, 70, TB_CYAN, 4, 2); // cima - A1
 
- 	for( j = 74; j < 77; j++)
-		PrintColumn(5, j, TB_CYAN, 6); // direita - A1
+ 	PrintRect(5, 74, TB_CYAN, 3, 6); // direita - A1
 
  	PrintLine(8, 70, TB_CYAN, 5); // baixo - A1
 
- 	for( j = 82; j < 85; j++)
- 		PrintColumn(5, j, TB_CYAN, 6); // T
+ 	PrintRect(5, 82, TB_CYAN, 3, 6); // T
 
- 	for( j = 5; j <7 ; j++)
- 		PrintLine(j, 79, TB_CYAN, 10); // cima - T
+ 	PrintRect(5, 79, TB_CYAN, 10, 2); // cima - T
 
- 	for( j = 91; j < 94; j++)
- 		PrintColumn(5, j, TB_CYAN, 6); // esquerda - A1
+ 	PrintRect(5, 91, TB_CYAN, 3, 6); // esquerda - A1
 
- 	for( j = 5; j <7; j++)
- 		PrintLine(j, 92, TB_CYAN, 4); // cima - A1
+ 	PrintRect(5, 92, TB_CYAN, 4, 2); // cima - A1
 
- 	for( j = 96; j < 99; j++)
- 		PrintColumn(5, j, TB_CYAN, 6); // direita - A1
+ 	PrintRect(5, 96, TB_CYAN, 3, 6); // direita - A1
 
  	PrintLine(8, 92, TB_CYAN, 5); // baixo - A1
 
@@ -998,26 +1220,26 @@ void DrawScr_Initial(void) {
 }
 
 /*
- * Desenha o nvel atual do jogo
+ * Desenha o nvel atual do jogo. A rua fica na camada 0 e s  desenhada
+ * ao entrar na LEVEL; o que se mexe fica na camada 1, que  apagada e
+ * redesenhada a cada quadro
  */
 void DrawScr_Level(GameData* Game) {
 
-	/* Aumenta o Game->Refresh e verifica se est na hora de aumentar o nvel */
-	UpdateLevel(Game);
-
-	/* Move os buracos para a esquerda se Game->Refresh >= 100 */
-	MoveHoles(Game);
+	/* Desenha as vias */
+	if (!Game->RoadDrawn) {
+		ClearScreen();
+		DrawStreetLane();
+		Game->RoadDrawn = true;
+	}
 
-	/* Calcula se houve alguma coliso */
-	CalculateColision(Game);
+	tb_select_layer(1);
+	tb_clear_buffer();
 
 	/* Desenha o LeFrata */
 	if (Game->Damage % 5 == 0)
 		DrawFrata(Game->Frata.y, Game->Frata.x);
 
-	/* Desenha as vias */
-	DrawStreetLane();
-
 	/* Desenha os buracos */
 	DrawHoles(Game);
 
@@ -1027,40 +1249,31 @@ void DrawScr_Level(GameData* Game) {
 	/* Desenha o indicador de nvel */
 	DrawLevelIndicator(Game);
 
-	/* Gera um novo buraco na tela */
-	GenerateNewHole(Game);
+	tb_select_layer(0);
 
 }
 
 /*
  * Desenha a tela de Pause
  */
-void DrawScr_Pause(void) {
-
-	ru8 x;
+void DrawArt_Pause(void) {
 
 	PrintLine(4, 17, TB_YELLOW, 5);
 	PrintLine(6, 17, TB_YELLOW, 5);
 
-	for(x = 17; x < 19; x++)
-		PrintColumn(4, x, TB_YELLOW, 5);
-	for(x = 22; x < 24; x++)
-		PrintColumn(4, x, TB_YELLOW, 3);
+	PrintRect(4, 17, TB_YELLOW, 2, 5);
+	PrintRect(4, 22, TB_YELLOW, 2, 3);
 
 	//a
 	PrintLine(4, 26, TB_YELLOW, 5);
 	PrintLine(6, 26, TB_YELLOW, 5);
 
-	for(x = 26; x < 28; x++)
-		PrintColumn(4, x, TB_YELLOW, 5);
-	for(x = 31; x < 33; x++)
-		PrintColumn(4, x, TB_YELLOW, 5);
+	PrintRect(4, 26, TB_YELLOW, 2, 5);
+	PrintRect(4, 31, TB_YELLOW, 2, 5);
 
 	//u
-	for(x = 35; x < 37; x++)
-		PrintColumn(4, x, TB_YELLOW, 5);
-	for(x = 40; x < 42; x++)
-		PrintColumn(4, x, TB_YELLOW, 5);
+	PrintRect(4, 35, TB_YELLOW, 2, 5);
+	PrintRect(4, 40, TB_YELLOW, 2, 5);
 
 	PrintLine(8, 35, TB_YELLOW, 5);
 
@@ -1069,272 +1282,193 @@ void DrawScr_Pause(void) {
 	PrintLine(6, 44, TB_YELLOW, 6);
 	PrintLine(8, 44, TB_YELLOW, 6);
 
-	for(x = 44; x < 46; x++)
-		PrintColumn(4, x, TB_YELLOW, 3);
-	for(x = 48; x < 50; x++)
-		PrintColumn(6, x, TB_YELLOW, 3);
+	PrintRect(4, 44, TB_YELLOW, 2, 3);
+	PrintRect(6, 48, TB_YELLOW, 2, 3);
 
 	//e
-	for(x = 52; x < 54; x++)
-		PrintColumn(4, x, TB_YELLOW, 5);
+	PrintRect(4, 52, TB_YELLOW, 2, 5);
 
 	PrintLine(4, 52, TB_YELLOW, 6);
 	PrintLine(6, 52, TB_YELLOW, 6);
 	PrintLine(8, 52, TB_YELLOW, 6);
 
 	//botao de pause
-	for(x = 29; x < 31; x++)
-		PrintColumn(10, x, TB_YELLOW, 9);
-	for(x = 44; x < 46; x++)
-		PrintColumn(10, x, TB_YELLOW, 9);
+	PrintRect(10, 29, TB_YELLOW, 2, 9);
+	PrintRect(10, 44, TB_YELLOW, 2, 9);
 
 	PrintLine(10, 30, TB_YELLOW, 14);
 	PrintLine(18, 30, TB_YELLOW, 14);
 
 	//setinha no meio
-	for(x = 35; x < 37; x++)
-		PrintColumn(12, x, TB_YELLOW, 5);
-	for(x = 37; x < 39; x++)
-		PrintColumn(13, x, TB_YELLOW, 3);
-	for(x = 39; x < 41; x++)
-		PrintColumn(14, x, TB_YELLOW, 1);
+	PrintRect(12, 35, TB_YELLOW, 2, 5);
+	PrintRect(13, 37, TB_YELLOW, 2, 3);
+	PrintRect(14, 39, TB_YELLOW, 2, 1);
 
 }
 
 /*
- * Desenha a tela de GameOver
+ * Desenha as partes fixas da tela de GameOver
  */
-void DrawScr_GameOver(GameData* Game) {
-
-	ru8 y, x;
+void DrawArt_GameOver(void) {
 
 	/*QUADRADOS ESQUERDA*/
 
-	for (x=3; x < 9; x++)
-		PrintColumn(4, x, TB_RED, 3);
+	PrintRect(4, 3, TB_RED, 6, 3);
 
-	for (x=3; x < 9; x++)
-		PrintColumn(8, x, TB_RED, 3);
+	PrintRect(8, 3, TB_RED, 6, 3);
 
-	for (x=3; x < 9; x++)
-		PrintColumn(12, x, TB_RED, 3);
+	PrintRect(12, 3, TB_RED, 6, 3);
 
-	for (x=3; x < 9; x++)
-		PrintColumn(16, x, TB_RED, 3);
+	PrintRect(16, 3, TB_RED, 6, 3);
 
-	for (x=3; x < 9; x++)
-		PrintColumn(20, x, TB_RED, 1);
+	PrintRect(20, 3, TB_RED, 6, 1);
 
 	/*G*/
 
-	for (y=4; y < 5; y++)
-		PrintLine(y, 16, TB_RED, 5);
+	PrintRect(4, 16, TB_RED, 5, 1);
 
-	for (x=15; x < 17; x++)
-		PrintColumn(5, x, TB_RED, 5);
+	PrintRect(5, 15, TB_RED, 2, 5);
 
-	for (y=10; y < 11; y++)
-		PrintLine(y, 16, TB_RED, 4);
+	PrintRect(10, 16, TB_RED, 4, 1);
 
-	for (x=19; x < 21; x++)
-		PrintColumn(8, x, TB_RED, 2);
+	PrintRect(8, 19, TB_RED, 2, 2);
 
-	for (y=7; y < 8; y++)
-		PrintLine(y, 18, TB_RED, 3);
+	PrintRect(7, 18, TB_RED, 3, 1);
 
-	for (x=17; x < 18; x++)
-		PrintColumn(11, x, TB_RED, 3);
+	PrintRect(11, 17, TB_RED, 1, 3);
 
-	for (x=18; x < 19; x++)
-		PrintColumn(11, x, TB_RED, 1);
+	PrintRect(11, 18, TB_RED, 1, 1);
 
 	/*A*/
 
-	for (x=22; x < 24; x++)
-		PrintColumn(4, x, TB_RED, 7);
+	PrintRect(4, 22, TB_RED, 2, 7);
 
-	for (y=4; y < 5; y++)
-		PrintLine(y, 24, TB_RED, 2);
+	PrintRect(4, 24, TB_RED, 2, 1);
 
-	for (y=7; y < 8; y++)
-		PrintLine(y, 24, TB_RED, 2);
+	PrintRect(7, 24, TB_RED, 2, 1);
 
-	for (x=26; x < 28; x++)
-		PrintColumn(4, x, TB_RED, 7);
+	PrintRect(4, 26, TB_RED, 2, 7);
 
-	for (x=23; x < 24; x++)
-		PrintColumn(11, x, TB_RED, 2);
+	PrintRect(11, 23, TB_RED, 1, 2);
 
-	for (x=26; x < 27; x++)
-		PrintColumn(11, x, TB_RED, 3);
+	PrintRect(11, 26, TB_RED, 1, 3);
 
 	/*M*/
 
-	for (x=29; x < 31; x++)
-		PrintColumn(4, x, TB_RED, 7);
+	PrintRect(4, 29, TB_RED, 2, 7);
 
-	for (y=4; y < 5; y++)
-		PrintLine(y, 31, TB_RED, 1);
+	PrintRect(4, 31, TB_RED, 1, 1);
 
-	for (x=32; x < 33; x++)
-		PrintColumn(5, x, TB_RED, 2);
+	PrintRect(5, 32, TB_RED, 1, 2);
 
-	for (y=4; y < 5; y++)
-		PrintLine(y, 33, TB_RED, 1);
+	PrintRect(4, 33, TB_RED, 1, 1);
 
-	for (x=34; x < 36; x++)
-		PrintColumn(4, x, TB_RED, 7);
+	PrintRect(4, 34, TB_RED, 2, 7);
 
-	for (x=29; x < 30; x++)
-		PrintColumn(11, x, TB_RED, 3);
+	PrintRect(11, 29, TB_RED, 1, 3);
 
-	for (x=34; x < 35; x++)
-		PrintColumn(11, x, TB_RED, 1);
+	PrintRect(11, 34, TB_RED, 1, 1);
 
 	/*E*/
 
-	for (x=37; x < 39; x++)
-		PrintColumn(4, x, TB_RED, 7);
+	PrintRect(4, 37, TB_RED, 2, 7);
 
-	for (y=4; y < 5; y++)
-		PrintLine(y, 39, TB_RED, 4);
+	PrintRect(4, 39, TB_RED, 4, 1);
 
-	for (y=7; y < 8; y++)
-		PrintLine(y, 39, TB_RED, 2);
+	PrintRect(7, 39, TB_RED, 2, 1);
 
-	for (y=10; y < 11; y++)
-		PrintLine(y, 39, TB_RED, 4);
+	PrintRect(10, 39, TB_RED, 4, 1);
 
-	for (x=40; x < 41; x++)
-		PrintColumn(11, x, TB_RED, 3);
+	PrintRect(11, 40, TB_RED, 1, 3);
 
 
-	for (x=38; x < 39; x++)
-		PrintColumn(11, x, TB_RED, 2);
+	PrintRect(11, 38, TB_RED, 1, 2);
 
-	for (x=41; x < 42; x++)
-		PrintColumn(11, x, TB_RED, 1);
+	PrintRect(11, 41, TB_RED, 1, 1);
 
 	/*O*/
 
-	for (x= 49; x < 51; x++)
-		PrintColumn(5, x, TB_RED, 5);
+	PrintRect(5, 49, TB_RED, 2, 5);
 
-	for (y=4; y < 5; y++)
-		PrintLine(y, 50, TB_RED, 4);
+	PrintRect(4, 50, TB_RED, 4, 1);
 
-	for (y=10; y < 11; y++)
-		PrintLine(y, 50, TB_RED, 4);
+	PrintRect(10, 50, TB_RED, 4, 1);
 
-	for (x= 53; x < 55; x++)
-		PrintColumn(5, x, TB_RED, 5);
+	PrintRect(5, 53, TB_RED, 2, 5);
 
-	for (x=51; x < 52; x++)
-		PrintColumn(11, x, TB_RED, 2);
+	PrintRect(11, 51, TB_RED, 1, 2);
 
-	for (x=52; x < 53; x++)
-		PrintColumn(11, x, TB_RED, 1);
+	PrintRect(11, 52, TB_RED, 1, 1);
 
 	/*V*/
 
-	for (x= 56; x < 58; x++)
-		PrintColumn(4, x, TB_RED, 5);
+	PrintRect(4, 56, TB_RED, 2, 5);
 
-	for (x=58; x < 59; x++)
-		PrintColumn(9, x, TB_RED, 2);
+	PrintRect(9, 58, TB_RED, 1, 2);
 
-	for (x=60; x < 61; x++)
-		PrintColumn(9, x, TB_RED, 2);
+	PrintRect(9, 60, TB_RED, 1, 2);
 
-	for (x= 61; x < 63; x++)
-		PrintColumn(4, x, TB_RED, 5);
+	PrintRect(4, 61, TB_RED, 2, 5);
 
-	for (x=59; x < 60; x++)
-		PrintColumn(11, x, TB_RED, 2);
+	PrintRect(11, 59, TB_RED, 1, 2);
 
 	/*E*/
 
-	for (x= 64; x < 66; x++)
-		PrintColumn(4, x, TB_RED, 7);
+	PrintRect(4, 64, TB_RED, 2, 7);
 
-	for (y=4; y < 5; y++)
-		PrintLine(y, 66, TB_RED, 4);
+	PrintRect(4, 66, TB_RED, 4, 1);
 
-	for (y=7; y < 8; y++)
-		PrintLine(y, 66, TB_RED, 2);
+	PrintRect(7, 66, TB_RED, 2, 1);
 
-	for (y=10; y < 11; y++)
-		PrintLine(y, 66, TB_RED, 4);
+	PrintRect(10, 66, TB_RED, 4, 1);
 
-	for (x=65; x < 66; x++)
-		PrintColumn(11, x, TB_RED, 1);
+	PrintRect(11, 65, TB_RED, 1, 1);
 
-	for (x=66; x < 67; x++)
-		PrintColumn(11, x, TB_RED, 2);
+	PrintRect(11, 66, TB_RED, 1, 2);
 
-	for (x=69; x < 70; x++)
-		PrintColumn(11, x, TB_RED, 3);
+	PrintRect(11, 69, TB_RED, 1, 3);
 
 	/*R*/
 
-	for (x= 71; x < 73; x++)
-		PrintColumn(4, x, TB_RED, 7);
+	PrintRect(4, 71, TB_RED, 2, 7);
 
-	for (y=4; y < 5; y++)
-		PrintLine(y, 73, TB_RED, 4);
+	PrintRect(4, 73, TB_RED, 4, 1);
 
-	for (x= 75; x < 77; x++)
-		PrintColumn(4, x, TB_RED, 3);
+	PrintRect(4, 75, TB_RED, 2, 3);
 
-	for (y=7; y < 8; y++)
-		PrintLine(y, 73, TB_RED, 4);
+	PrintRect(7, 73, TB_RED, 4, 1);
 
-	for (y=8; y < 9; y++)
-		PrintLine(y, 73, TB_RED, 1);
+	PrintRect(8, 73, TB_RED, 1, 1);
 
-	for (y=9; y < 10; y++)
-		PrintLine(y, 74, TB_RED, 1);
+	PrintRect(9, 74, TB_RED, 1, 1);
 
-	for (x=75; x < 76; x++)
-		PrintColumn(10, x, TB_RED, 3);
+	PrintRect(10, 75, TB_RED, 1, 3);
 
 	/*QUADRADOS DIREITA*/
 
-	for (x= 84; x < 90; x++)
-		PrintColumn(4, x, TB_RED, 3);
+	PrintRect(4, 84, TB_RED, 6, 3);
 
-	for (x= 84; x < 90; x++)
-		PrintColumn(8, x, TB_RED, 3);
+	PrintRect(8, 84, TB_RED, 6, 3);
 
-	for (x= 84; x < 90; x++)
-		PrintColumn(12, x, TB_RED, 3);
+	PrintRect(12, 84, TB_RED, 6, 3);
 
-	for (x= 84; x < 90; x++)
-		PrintColumn(16, x, TB_RED, 3);
+	PrintRect(16, 84, TB_RED, 6, 3);
 
-	for (x= 84; x < 90; x++)
-		PrintColumn(20, x, TB_RED, 1);
+	PrintRect(20, 84, TB_RED, 6, 1);
 
 
 	/*ENTRADAS MARGEM*/
 
 
-	for (y = 16; y < 17; y++)
-		PrintLine(y, 15, TB_WHITE, 62);
+	PrintRect(16, 15, TB_WHITE, 62, 1);
 
-	for (x = 15; x < 16; x++)
-		PrintColumn(16, x, TB_WHITE, 4);
+	PrintRect(16, 15, TB_WHITE, 1, 4);
 
-	for (y = 20; y < 21; y++)
-		PrintLine(y, 15, TB_WHITE, 62);
+	PrintRect(20, 15, TB_WHITE, 62, 1);
 
-	for (x = 76; x < 77; x++)
-		PrintColumn(16, x, TB_WHITE, 4);
+	PrintRect(16, 76, TB_WHITE, 1, 4);
 
 
-	/* Imprime o Score na tela GameOver*/
-	tb_stringf(22, 18, TB_WHITE, TB_BLUE, "SCORE %" PRIu64, Game->Player.Score);
-
 	/* ENTRADAS */
 
 	tb_string(35, 18, TB_WHITE, TB_RED, "(T)RY AGAIN");
@@ -1344,27 +1478,32 @@ void DrawScr_GameOver(GameData* Game) {
 }
 
 /*
- * Desenha a tela com os rankings
+ * Desenha a tela de GameOver
  */
-void DrawScr_Ranking(GameData* Game) {
+void DrawScr_GameOver(GameData* Game) {
 
-	ru8 x;
+	tb_blit(0, 0, Game->Art[ART_GAMEOVER]);
+
+	/* Imprime o Score na tela GameOver*/
+	tb_stringf(22, 18, TB_WHITE, TB_BLUE, "SCORE %" PRIu64, Game->Player.Score);
+
+}
+
+/*
+ * Desenha as partes fixas da tela com os rankings
+ */
+void DrawArt_Ranking(void) {
 
     //tabela
-	for (x = 17; x < 78; x++)
-		PrintColumn(4, x, TB_CYAN, 7);
+	PrintRect(4, 17, TB_CYAN, 61, 7);
 
-	for (x = 17; x < 19; x++)
-		PrintColumn(11, x, TB_CYAN, 12);
+	PrintRect(11, 17, TB_CYAN, 2, 12);
 
-	for (x = 76; x < 78; x++)
-		PrintColumn(11, x, TB_CYAN, 12);
+	PrintRect(11, 76, TB_CYAN, 2, 12);
 
-	for (x = 37; x < 39; x++)
-		PrintColumn(11, x, TB_CYAN, 12);
+	PrintRect(11, 37, TB_CYAN, 2, 12);
 
-	for (x = 56; x < 58; x++)
-		PrintColumn(11, x, TB_CYAN, 12);
+	PrintRect(11, 56, TB_CYAN, 2, 12);
 
 
 	PrintLine(22, 19, TB_CYAN, 57);
@@ -1442,6 +1581,15 @@ void DrawScr_Ranking(GameData* Game) {
 	tb_string(23, 16, TB_WHITE, TB_BLACK, "BEST TODAY");
 	tb_string(23, 20, TB_WHITE, TB_BLACK, "LAST SCORE");
 
+}
+
+/*
+ * Desenha a tela com os rankings
+ */
+void DrawScr_Ranking(GameData* Game) {
+
+	tb_blit(0, 0, Game->Art[ART_RANKING]);
+
 	tb_stringf(45, 12, TB_WHITE, TB_BLACK, "%" PRIu64, 
 			Game->Scores.Sc_highest.Score);
 	tb_stringf(45, 16, TB_WHITE, TB_BLACK, "%" PRIu64, 
@@ -1465,13 +1613,9 @@ void DrawScr_Ranking(GameData* Game) {
 }
 
 /*
- * Desenha a tela que diz "Score salvo"
+ * Desenha as partes fixas da tela que diz "Score salvo"
  */
-void DrawScr_SaveScore(GameData* Game) {
-
-	ClearScreen();
-    
-	ru8 x;
+void DrawArt_SaveScore(void) {
 
     //s
 	PrintLine(7, 22, TB_BLUE, 5);
@@ -1540,39 +1684,22 @@ void DrawScr_SaveScore(GameData* Game) {
 
 	tb_string(45, 14, TB_WHITE, TB_BLACK, "Clique para sair:");
 
-	for (x = 49; x < 57; x++) {
-		tb_char(x, 16, TB_BLACK, TB_WHITE, ' ');
-		tb_char(x, 20, TB_BLACK, TB_WHITE, ' ');
-	}
+	tb_hline(49, 16, 8, TB_BLACK, TB_WHITE, ' ');
+	tb_hline(49, 20, 8, TB_BLACK, TB_WHITE, ' ');
 
-	tb_char(49, 17, TB_BLACK, TB_WHITE, ' ');
-	tb_char(49, 19, TB_BLACK, TB_WHITE, ' ');
-
-	for (x = 17; x < 20; x++) {
-		tb_char(49, x, TB_BLACK, TB_WHITE, ' ');
-		tb_char(56, x, TB_BLACK, TB_WHITE, ' ');
-	}
+	tb_vline(49, 17, 3, TB_BLACK, TB_WHITE, ' ');
+	tb_vline(56, 17, 3, TB_BLACK, TB_WHITE, ' ');
 
 	tb_string(51, 18, TB_WHITE, TB_BLUE, "(O)K");
 
-	SaveScorePlayer(Game->Scores.File, Game->Player);
-
-	while (tb_peek_event(&(Game->Event), 10) != 10) {
-
-		switch (Game->Event.ch) {
-
-			case 'o':
-			case 'O':
-			case 'q':
-			case 'Q':
-				Quit(Game);
-				break;
-
-		}
+}
 
-		tb_render();
+/*
+ * Desenha a tela que diz "Score salvo"
+ */
+void DrawScr_SaveScore(GameData* Game) {
 
-	}
+	tb_blit(0, 0, Game->Art[ART_SAVESCORE]);
 
 }
 
@@ -1580,63 +1707,51 @@ void DrawScr_SaveScore(GameData* Game) {
 /*
  * Desenha a primeira pgina do About
  */
-void DrawScr_AboutPage_1(void){
-
-	ru8 i;
+void DrawArt_AboutPage_1(void){
 
 	/* Desenha ABOUT na tela */
 
 	// Desenha A
-	for( i = 29; i < 31; i++ )
-		PrintColumn(1, i, TB_BLUE, 5);
+	PrintRect(1, 29, TB_BLUE, 2, 5);
 
 	PrintLine(1, 31, TB_BLUE, 3);
 	PrintLine(3, 31, TB_BLUE, 3);
 
-	for( i = 34 ; i < 36; i++ )
-		PrintColumn(1, i, TB_BLUE, 5);
+	PrintRect(1, 34, TB_BLUE, 2, 5);
 
 
 	// Desenha B
-	for( i = 38; i < 40; i++ )
-		PrintColumn(1, i, TB_BLUE, 4);
+	PrintRect(1, 38, TB_BLUE, 2, 4);
 
 	PrintLine(1, 39, TB_BLUE, 4);
 	PrintLine(3, 39, TB_BLUE, 4);
 
-	for( i = 42 ; i < 44; i++ )
-		PrintColumn(1, i, TB_BLUE, 2);
+	PrintRect(1, 42, TB_BLUE, 2, 2);
 
-	for( i = 43; i < 45; i++ )
-		PrintColumn(3, i, TB_BLUE, 2);
+	PrintRect(3, 43, TB_BLUE, 2, 2);
 
 	PrintLine(5, 38, TB_BLUE, 7);
 
 
 	// Desenha O
-	for( i = 47; i< 49; i++ )
-		PrintColumn(1, i, TB_BLUE, 5);
+	PrintRect(1, 47, TB_BLUE, 2, 5);
 
 	PrintLine(1, 49, TB_BLUE, 3);
 	PrintLine(5, 49, TB_BLUE, 3);
 
-	for( i = 52 ; i < 54; i++ )
-		PrintColumn(1, i, TB_BLUE, 5);
+	PrintRect(1, 52, TB_BLUE, 2, 5);
 
 
 	// Desenha U
-	for( i = 56; i < 58; i++ )
-		PrintColumn(1, i, TB_BLUE, 5);
+	PrintRect(1, 56, TB_BLUE, 2, 5);
 
 	PrintLine(5, 58, TB_BLUE, 3);
 
-	for( i = 61 ; i < 63; i++ )
-		PrintColumn(1, i, TB_BLUE, 5);
+	PrintRect(1, 61, TB_BLUE, 2, 5);
 
 
 	// Desenha T
-	for( i = 67; i< 69; i++ )
-		PrintColumn(1, i, TB_BLUE, 5);
+	PrintRect(1, 67, TB_BLUE, 2, 5);
 
 	PrintLine(1, 65 , TB_BLUE, 6);
 
@@ -1677,7 +1792,7 @@ void DrawScr_AboutPage_1(void){
 /*
  * Desenha a segunda pgina do About
  */
-void DrawScr_AboutPage_2(void){
+void DrawArt_AboutPage_2(void){
 
 	/* Imprime os cabealho */
 	tb_stringf(2, 1, TB_WHITE, TB_BLACK, "P%lcGINA 1/2", AC_ACUTE);
@@ -1691,14 +1806,8 @@ void DrawScr_AboutPage_2(void){
 
 
 	/* Imprime as linhas de diviso da tela */
-	ru8 i;
-
-	for (i = 3; i < 23; i++) {
-		tb_char(50, i, TB_WHITE, TB_BLUE, ' ');
-		tb_char(51, i, TB_WHITE, TB_BLUE, ' ');
-	}
-	for (i = 63; i < 105; i++)
-		tb_char(i, 14, TB_WHITE, TB_BLUE, ' ');
+	tb_fill_rect(50, 3, 2, 20, TB_WHITE, TB_BLUE, ' ');
+	tb_hline(63, 14, 41, TB_WHITE, TB_BLUE, ' ');
     
 
     /* Imprime as instrues de movimentao */
@@ -1774,11 +1883,11 @@ void DrawAbout(GameData* Game) {
     switch (Game->About){
 
         case PAGE_1:
-            DrawScr_AboutPage_1();
+            tb_blit(0, 0, Game->Art[ART_ABOUT_1]);
             break;
 
         case PAGE_2:
-            DrawScr_AboutPage_2();
+            tb_blit(0, 0, Game->Art[ART_ABOUT_2]);
 			break;
 
      }
@@ -1786,17 +1895,55 @@ void DrawAbout(GameData* Game) {
 }
 
 /*
- * Imprime plano de fundo preto no buffer inteiro
- * TODO: utilizar tb_clear_screen()
+ * Desenha uma vez s as partes fixas de cada tela, cada uma no seu sprite.
+ * A cada quadro basta copi-las com tb_blit()
  */
-void ClearScreen(void) {
+void LoadArt(GameData* Game) {
 
-	tb_clear_buffer();
+	void (*Draw[NB_ART])(void) = {
+		DrawArt_Initial, DrawArt_Pause, DrawArt_GameOver, DrawArt_Ranking,
+		DrawArt_SaveScore, DrawArt_AboutPage_1, DrawArt_AboutPage_2
+	};
+
+	ru8 i;
+
+	for (i = 0; i < NB_ART; i++) {
+
+		Game->Art[i] = tb_sprite_new(ART_W, ART_H, NULL);
+
+		if (Game->Art[i] == NULL)
+			Error(NULL, ENOMEM, "tb_sprite_new");
+
+		/* Desenha no sprite em vez do buffer da tela */
+		tb_select_sprite(Game->Art[i]);
+
+		ClearScreen();
+		Draw[i]();
+
+	}
+
+	tb_select_sprite(NULL);
 
-	ru8 y;
+}
+
+/*
+ * Esquece a imagem do ranking e a rua, que sero desenhadas de novo
+ * (no incio e a cada resize)
+ */
+void InitCache(GameData* Game) {
+
+	Game->RankingDrawn	= false;
+	Game->RoadDrawn		= false;
+
+}
+
+/*
+ * Imprime plano de fundo preto na rea do jogo
+ * (nada  desenhado fora dela)
+ */
+void ClearScreen(void) {
 
-	for (y = 0; y < 24; y++)
-		tb_empty(1, y, TB_BLACK, 103);
+	tb_clear_region(1, 0, 103, 24);
 
 }
 
@@ -1805,14 +1952,36 @@ void ClearScreen(void) {
  */
 void DrawScreen(GameData* Game) {
 
-	switch (Game->Screen) {
+	/*
+	 * Qualquer outra tela desenha por cima da rua na camada 0, e os
+	 * sprites da camada 1 no podem ficar por cima dela
+	 */
+	if (Game->Drawn == LEVEL && Game->Screen != LEVEL) {
+		tb_select_layer(1);
+		tb_clear_buffer();
+		tb_select_layer(0);
+		Game->RoadDrawn = false;
+	}
 
-		case LEVEL:
-			DrawScr_Level(Game);
-			break;
+	Game->Drawn = Game->Screen;
+
+	if (Game->Screen == LEVEL) {
+		DrawScr_Level(Game);
+		return;
+	}
+
+	/* O ranking, se no mudou desde o ltimo desenho,  s copiado */
+	if (Game->Screen == RANKING && Game->RankingDrawn) {
+		tb_blit(0, 0, Game->Ranking);
+		return;
+	}
+
+	ClearScreen();
+
+	switch (Game->Screen) {
 
 		case PAUSE:
-			DrawScr_Pause();
+			tb_blit(0, 0, Game->Art[ART_PAUSE]);
 			break;
 
 		case GAMEOVER:
@@ -1832,10 +2001,19 @@ void DrawScreen(GameData* Game) {
 			break;
 
 		default:
-			DrawScr_Initial();
+			tb_blit(0, 0, Game->Art[ART_INITIAL]);
 
 	}
 
+	/*
+	 * As outras telas j so cpias dos sprites em Art, guardar a
+	 * imagem delas s duplicaria esses sprites
+	 */
+	if (Game->Screen == RANKING) {
+		Game->Ranking		= tb_snapshot(Game->Ranking);
+		Game->RankingDrawn	= (Game->Ranking != NULL);
+	}
+
 }
 
 /*
@@ -1864,33 +2042,374 @@ void UpdatePosition(GameData* Game) {
 
 }
 
+/*
+ * Trata os argumentos: --record abre um registro novo com uma seed nova,
+ * --replay l a seed, o tamanho da tela e a data de um registro j feito
+ */
+void OpenLog(GameData* Game, int argc, const char* argv[]) {
+
+	Game->Log		= NULL;
+	Game->Replay	= false;
+	Game->Seed		= (unsigned) time(NULL);
+
+	GetCurrentDate(&(Game->Today));
+
+	if (argc == 1)
+		return;
+
+	if (argc != 3)
+		errx(EXIT_FAILURE, "uso: %s [--record|--replay arquivo]", argv[0]);
+
+	if (strcmp(argv[1], "--record") == 0) {
+
+		if ((Game->Log = fopen(argv[2], "w")) == NULL)
+			err(errno, "%s", argv[2]);
+
+	} else if (strcmp(argv[1], "--replay") == 0) {
+
+		if ((Game->Log = fopen(argv[2], "r")) == NULL)
+			err(errno, "%s", argv[2]);
+
+		if (fscanf(Game->Log, "frata %u %" SCNuFAST16 " %" SCNuFAST16 " %d %d %d",
+				&(Game->Seed), &(Game->Width), &(Game->Height), &(Game->Today.tm_mday),
+				&(Game->Today.tm_mon), &(Game->Today.tm_year)) != 6)
+			errx(EXIT_FAILURE, "%s: registro invalido", argv[2]);
+
+		Game->Replay = true;
+
+	} else
+		errx(EXIT_FAILURE, "uso: %s [--record|--replay arquivo]", argv[0]);
+
+}
+
+/*
+ * Grava no registro os scores lidos do arquivo, depois do cabealho
+ */
+void WriteScores(GameData* Game) {
+
+	ru16 i;
+
+	fprintf(Game->Log, "%" PRIuFAST16 "\n", Game->Scores.np);
+
+	for (i = 0; i < Game->Scores.np; i++)
+		fprintf(Game->Log, "%" PRIu64 " %d %d %d\n", Game->Scores.Players[i].Score,
+				Game->Scores.Players[i].Date.tm_mday,
+				Game->Scores.Players[i].Date.tm_mon,
+				Game->Scores.Players[i].Date.tm_year);
+
+}
+
+/*
+ * L os scores gravados no registro por WriteScores, no lugar do arquivo
+ */
+void ReadScores(GameData* Game) {
+
+	Game->Scores.File = NULL;
+
+	if (fscanf(Game->Log, "%" SCNuFAST16, &(Game->Scores.np)) != 1 || Game->Scores.np == 0)
+		errx(EXIT_FAILURE, "registro invalido");
+
+	if ((Game->Scores.Players = (ScEntry *) malloc(Game->Scores.np * sizeof(ScEntry))) == NULL)
+		Error(Game, errno, "malloc");
+
+	FillEntries(Game, Game->Log);
+
+}
+
+/*
+ * Registra Game->Event junto do tick em que ele foi tratado
+ */
+void RecordEvent(GameData* Game) {
+
+	struct tb_event* Ev = &(Game->Event);
+
+	fprintf(Game->Log, "%" PRIu64 " %u %u %" PRIu32 " %u %d %d %d %d\n",
+			Game->Ticks, Ev->type, Ev->key, Ev->ch, Ev->meta,
+			Ev->w, Ev->h, Ev->x, Ev->y);
+
+}
+
+/*
+ * L o prximo evento do registro para Game->Event e o seu tick para At
+ * Retorna false no fim do registro
+ */
+bool ReadEvent(GameData* Game, u64* At) {
+
+	struct tb_event* Ev = &(Game->Event);
+	unsigned Type, Key, Meta;
+	int w, h, x, y;
+
+	memset(Ev, 0, sizeof(struct tb_event));
+
+	if (fscanf(Game->Log, "%" SCNuFAST64 " %u %u %" SCNu32 " %u %d %d %d %d",
+			At, &Type, &Key, &(Ev->ch), &Meta, &w, &h, &x, &y) != 9)
+		return false;
+
+	Ev->type	= Type;
+	Ev->key		= Key;
+	Ev->meta	= Meta;
+	Ev->w		= w;
+	Ev->h		= h;
+	Ev->x		= x;
+	Ev->y		= y;
+
+	return true;
+
+}
+
+/*
+ * Desenha um quadro no replay, no mximo um a cada FRAME_MS ms de simulao
+ * enquanto algo se move, como no jogo
+ */
+void ReplayFrame(GameData* Game) {
+
+	cu64 SimTime = Game->Ticks * TICK_MS;
+	u64 Start;
+
+	if (!Game->Redraw || (Game->Ticking && SimTime < Game->NextFrame))
+		return;
+
+	Game->Redraw	= false;
+	Game->NextFrame	= SimTime + FRAME_MS;
+
+	Start = GetTimeNs();
+	DrawScreen(Game);
+	DrawOverlay(Game);
+	Game->Time[SUB_DRAW] += GetTimeNs() - Start;
+
+	Start = GetTimeNs();
+	tb_render();
+	Game->Time[SUB_RENDER] += GetTimeNs() - Start;
+
+	Game->Frames++;
+
+}
+
+/*
+ * Reproduz o registro o mais rpido possvel: os ticks registrados antes de
+ * cada evento, depois o evento. Termina em Quit(), que imprime o relatrio
+ */
+void Replay(GameData* Game) {
+
+	u64 At, Start;
+
+	Game->Start		= GetTimeNs();
+	Game->NextFrame	= 0;
+
+	while (ReadEvent(Game, &At)) {
+
+		while (Game->Ticks < At) {
+
+			Start = GetTimeNs();
+			Tick(Game);
+			Game->Time[SUB_TICK] += GetTimeNs() - Start;
+
+			Game->Redraw = true;
+			ReplayFrame(Game);
+
+		}
+
+		Start = GetTimeNs();
+		HandleInput(Game);
+		Game->Time[SUB_INPUT] += GetTimeNs() - Start;
+
+		Game->Redraw = true;
+		UpdateTimer(Game);
+		ReplayFrame(Game);
+
+	}
+
+	Quit(Game);
+
+}
+
+/*
+ * Imprime quantos quadros por segundo o replay fez e onde o tempo foi gasto
+ */
+void PrintReport(GameData* Game) {
+
+	static const char* Names[NB_SUB] = { "input", "ticks", "desenho", "render" };
+
+	cu64 Total = GetTimeNs() - Game->Start;
+	ru8 i;
+
+	printf("%" PRIu64 " quadros, %" PRIu64 " ticks em %.3f s: %.1f quadros/s\n",
+			Game->Frames, Game->Ticks, Total / 1e9,
+			(Total > 0) ? Game->Frames * 1e9 / Total : 0.0);
+
+	for (i = 0; i < NB_SUB; i++)
+		printf("  %-8s %10.3f ms %6.1f%%\n", Names[i], Game->Time[i] / 1e6,
+				(Total > 0) ? 100.0 * Game->Time[i] / Total : 0.0);
+
+}
+
+/*
+ * Desenha as estatsticas do ltimo quadro da termbox no canto superior
+ * direito, na camada 1 para que a tela por baixo volte ao escond-las
+ */
+void DrawOverlay(GameData* Game) {
+
+	struct tb_stats Frame;
+	ci16 x = tb_width() - 34;
+
+	tb_select_layer(1);
+
+	/* A LEVEL j limpa a camada 1 a cada quadro */
+	if (Game->Screen != LEVEL)
+		tb_clear_buffer();
+
+	if (Game->Overlay) {
+
+		tb_get_stats(&Frame, NULL);
+
+		tb_fill_rect(x, 1, 33, 6, TB_WHITE, TB_BLACK, ' ');
+		tb_string(x + 1, 1, TB_YELLOW, TB_BLACK, "termbox, ultimo quadro (F12)");
+		tb_stringf(x + 1, 2, TB_WHITE, TB_BLACK, "diff    %6" PRIu64 " us flush %6" PRIu64 " us",
+				Frame.diff_ns / 1000, Frame.flush_ns / 1000);
+		tb_stringf(x + 1, 3, TB_WHITE, TB_BLACK, "compar. %6" PRIu64 "    envia %6" PRIu64,
+				Frame.cells_compared, Frame.cells_emitted);
+		tb_stringf(x + 1, 4, TB_WHITE, TB_BLACK, "cursor  %6" PRIu64 "    sgr   %6" PRIu64,
+				Frame.cursor_jumps, Frame.sgr_switches);
+		tb_stringf(x + 1, 5, TB_WHITE, TB_BLACK, "bytes   %6" PRIu64 "    write %6" PRIu64,
+				Frame.bytes_written, Frame.writes);
+
+	}
+
+	tb_select_layer(0);
+
+}
+
+/*
+ * Imprime os contadores da termbox desde o incio do jogo
+ */
+void PrintStats(const struct tb_stats* Total) {
+
+	cu64 Frames = (Total->frames > 0) ? Total->frames : 1;
+
+	printf("termbox: %" PRIu64 " quadros\n", Total->frames);
+	printf("  %-10s %12" PRIu64 " %10.1f/quadro\n", "comparadas",
+			Total->cells_compared, (double) Total->cells_compared / Frames);
+	printf("  %-10s %12" PRIu64 " %10.1f/quadro\n", "enviadas",
+			Total->cells_emitted, (double) Total->cells_emitted / Frames);
+	printf("  %-10s %12" PRIu64 " %10.1f/quadro\n", "cursor",
+			Total->cursor_jumps, (double) Total->cursor_jumps / Frames);
+	printf("  %-10s %12" PRIu64 " %10.1f/quadro\n", "sgr",
+			Total->sgr_switches, (double) Total->sgr_switches / Frames);
+	printf("  %-10s %12" PRIu64 " %10.1f/quadro\n", "bytes",
+			Total->bytes_written, (double) Total->bytes_written / Frames);
+	printf("  %-10s %12" PRIu64 " %10.1f/quadro\n", "writes",
+			Total->writes, (double) Total->writes / Frames);
+	printf("  %-10s %12.3f ms %7.1f us/quadro\n", "diff",
+			Total->diff_ns / 1e6, Total->diff_ns / 1e3 / Frames);
+	printf("  %-10s %12.3f ms %7.1f us/quadro\n", "flush",
+			Total->flush_ns / 1e6, Total->flush_ns / 1e3 / Frames);
+
+}
+
 /*
  * Van Le Frata, o grande esquivador de buracos
  */
 int main(int argc, const char* argv[]) {
 
-	(void) argc; (void) argv;
-
 	setlocale(LC_CTYPE, "");
 
 	GameData Game;
+	struct tb_event Events[MAX_EVENTS];
+	u64 Now;
+	int Result, i;
+	ru8 n;
+
+	OpenLog(&Game, argc, argv);
+
+	/* Uma seed s, para que o registro possa reproduzir o jogo */
+	srand(Game.Seed);
+
+	Game.Ticks		= 0;
+	Game.Frames		= 0;
+	Game.Overlay	= false;
+
+	for (i = 0; i < NB_SUB; i++)
+		Game.Time[i] = 0;
 
-	InitScreen();
+	InitScreen(&Game);
+	LoadArt(&Game);
+
+	Game.Ranking = NULL;
+	InitCache(&Game);
+	Game.Drawn = NB_SCR;
 
 	InitData(&Game);
 	OpenFile(&Game);
 
-	/* Atualiza a tela a cada 10 ms */
-	while (tb_peek_event(&(Game.Event), 10) != -1) {
+	Game.Ticking	= false;
+	Game.Redraw		= true;
+	Game.NextFrame	= GetTime();
 
-		/* Limpa a tela */
-		ClearScreen();
+	if (Game.Replay)
+		Replay(&Game);
+
+	while (1) {
+
+		/*
+		 * Com um quadro pendente, espera no mximo at a hora dele. Seno,
+		 * dorme at o prximo evento: input, resize ou tick (s na LEVEL)
+		 */
+		Now = GetTime();
+
+		Result = tb_peek_events(Events, MAX_EVENTS, (!Game.Redraw) ? -1 :
+				(Game.NextFrame > Now) ? (int) (Game.NextFrame - Now) : 0);
+
+		if (Result == -1)
+			break;
+
+		/* Recebe todo o input pendente do usurio antes de um nico quadro */
+		for (i = 0; i < Result; i++) {
+
+			Game.Event = Events[i];
+
+			if (Game.Event.type != TB_EVENT_TICK)
+				Game.Redraw = true;
+
+			/* Os ticks no entram no registro, o replay os refaz */
+			if (Game.Log != NULL && Game.Event.type != TB_EVENT_TICK)
+				RecordEvent(&Game);
+
+			HandleInput(&Game);
+
+		}
+
+		/*
+		 * Passo fixo: roda um tick para cada TICK_MS ms passados, no importa
+		 * quantos eventos chegaram. Se o atraso for grande demais, descarta
+		 */
+		Now = GetTime();
+
+		if (Game.Ticking) {
+
+			for (n = 0; Now >= Game.NextTick && n < MAX_TICKS; n++) {
+				Tick(&Game);
+				Game.NextTick += TICK_MS;
+				Game.Redraw = true;
+			}
+
+			if (Now >= Game.NextTick)
+				Game.NextTick = Now + TICK_MS;
+
+		}
+
+		/* Liga ou desliga o timer caso a tela tenha mudado */
+		UpdateTimer(&Game);
+
+		/* Renderiza no mximo um quadro a cada FRAME_MS ms */
+		if (!Game.Redraw || Now < Game.NextFrame)
+			continue;
 
-		/* Recebe o input do usurio */
-		HandleInput(&Game);
+		Game.Redraw		= false;
+		Game.NextFrame	= Now + FRAME_MS;
 
-		/* Desenha alguma tela */
+		/* Limpa e desenha alguma tela, ou copia a j guardada */
 		DrawScreen(&Game);
+		DrawOverlay(&Game);
 
 		/* Renderizao */
 		tb_render();
@@ -0,0 +1,172 @@
+// renders scripted frame sequences into a file through the headless backend
+// and reports how long tb_render() took and how much it sent, per frame.
+//
+//   bench [frames [width height]]
+//
+// the escape sequences come from $TERM (xterm-256color if unset).
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "../src/termbox.h"
+
+static int frames = 1000;
+static int width = 104;
+static int height = 24;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// every cell changes every frame
+static void fill_frame(int f) {
+  int x, y;
+
+  for (y = 0; y < height; y++) {
+    for (x = 0; x < width; x++)
+      tb_char(x, y, (x + f) % 256, (y * 7 + f) % 256, 'a' + (x + y + f) % 26);
+  }
+}
+
+// every cell changes attributes, so sgr0 and the attribute strings from
+// terminfo go out all the time
+static void attrs_frame(int f) {
+  static const tb_color attrs[] = { 0, TB_BOLD, TB_UNDERLINE, TB_BOLD | TB_REVERSE };
+  int x, y;
+
+  for (y = 0; y < height; y++) {
+    for (x = 0; x < width; x++)
+      tb_char(x, y, TB_WHITE | attrs[(x + y + f) % 4], TB_DEFAULT, 'a' + (x + f) % 26);
+  }
+}
+
+// a few small boxes wander over a background drawn once
+static void sprites_setup(void) {
+  int x, y;
+
+  for (y = 0; y < height; y++) {
+    for (x = 0; x < width; x++)
+      tb_char(x, y, TB_BLUE, TB_DEFAULT, (x + y) % 4 ? ' ' : '.');
+  }
+  tb_select_layer(1);
+}
+
+static void sprites_frame(int f) {
+  int i, x, y;
+
+  tb_clear_buffer();
+  for (i = 0; i < 8; i++) {
+    x = (f + i * 13) % (width + 6) - 6;
+    y = (i * 5 + f / 4) % (height + 3) - 3;
+    tb_fill_rect(x, y, 6, 3, TB_WHITE, 1 + i % 7, ' ');
+    tb_string(x + 1, y + 1, TB_BLACK, 1 + i % 7, "ooo");
+  }
+}
+
+// frata's LEVEL screen: the road stays, the van and the holes move over it
+static void level_setup(void) {
+  int i;
+
+  tb_hline(2, 1, 100, TB_WHITE, TB_WHITE, ' ');
+  for (i = 0; i < 5; i++)
+    tb_hline(8 + i * 20, 12, 10, TB_WHITE, TB_YELLOW, ' ');
+  tb_hline(2, 23, 100, TB_WHITE, TB_WHITE, ' ');
+  tb_select_layer(1);
+}
+
+static void level_frame(int f) {
+  int i, x, y = f / 60 % 2 ? 13 : 2; // changes lanes once in a while
+
+  tb_clear_buffer();
+
+  tb_hline(16, y + 2, 9, TB_WHITE, TB_MAGENTA, ' ');
+  tb_hline(25, y + 2, 2, TB_WHITE, TB_CYAN, ' ');
+  tb_hline(16, y + 3, 13, TB_WHITE, TB_MAGENTA, ' ');
+  tb_hline(28, y + 3, 1, TB_WHITE, TB_YELLOW, ' ');
+  tb_hline(16, y + 4, 13, TB_WHITE, TB_BLUE, ' ');
+  tb_hline(16, y + 5, 13, TB_WHITE, TB_MAGENTA, ' ');
+  tb_hline(17, y + 6, 2, TB_WHITE, TB_WHITE, ' ');
+  tb_hline(25, y + 6, 2, TB_WHITE, TB_WHITE, ' ');
+
+  for (i = 0; i < 6; i++) {
+    x = 100 - (f + i * 17) % 84;
+    tb_fill_rect(x, (i % 2 ? 13 : 2) + 3, 6, 3, TB_WHITE, TB_RED, ' ');
+  }
+
+  tb_string(70, 21, TB_WHITE, TB_BLACK, "VIDAS = ");
+  for (i = 0; i < 3; i++)
+    tb_char(78 + i, 21, TB_RED, TB_BLACK, 0x2666);
+  tb_stringf(87, 21, TB_WHITE, TB_BLACK, "LEVEL = %d", 1 + f / 100);
+}
+
+static int run(int fd, const char *name, void (*setup)(void), void (*frame)(int)) {
+  uint64_t start, total = 0;
+  off_t bytes;
+  int f;
+
+  if (ftruncate(fd, 0) != 0 || tb_init_headless(dup(fd), width, height) != 0)
+    return -1;
+  tb_init_screen(TB_INIT_ALTSCREEN | TB_INIT_NO_CURSOR);
+  tb_select_output_mode(TB_OUTPUT_256);
+
+  if (setup) setup();
+  frame(0);
+  tb_render(); // the first one draws everything, leave it out
+  lseek(fd, 0, SEEK_SET);
+
+  for (f = 1; f <= frames; f++) {
+    frame(f);
+    start = now_ns();
+    tb_render();
+    total += now_ns() - start;
+  }
+
+  bytes = lseek(fd, 0, SEEK_CUR);
+  tb_shutdown();
+
+  printf("%-8s %10.0f ns/frame %10.1f bytes/frame\n", name,
+    (double)total / frames, (double)bytes / frames);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  char path[] = "/tmp/tb-bench-XXXXXX";
+  int fd, res = 0;
+
+  if (argc > 1) frames = atoi(argv[1]);
+  if (argc > 3) {
+    width = atoi(argv[2]);
+    height = atoi(argv[3]);
+  }
+  if (frames < 1 || width < 1 || height < 1) {
+    fprintf(stderr, "usage: %s [frames [width height]]\n", argv[0]);
+    return 1;
+  }
+
+  setenv("TERM", "xterm-256color", 0);
+
+  fd = mkstemp(path);
+  if (fd < 0) {
+    perror("mkstemp");
+    return 1;
+  }
+  unlink(path);
+
+  printf("%d frames of %dx%d, TERM=%s\n", frames, width, height, getenv("TERM"));
+  if (run(fd, "fill", NULL, fill_frame) < 0 ||
+      run(fd, "attrs", NULL, attrs_frame) < 0 ||
+      run(fd, "sprites", sprites_setup, sprites_frame) < 0 ||
+      run(fd, "level", level_setup, level_frame) < 0) {
+    fprintf(stderr, "couldn't start termbox\n");
+    res = 1;
+  }
+
+  close(fd);
+  return res;
+}
@@ -1,9 +1,36 @@
+// a piece of queued output: bytes in buf at 'off' if 'ref' is NULL, otherwise
+// a string that outlives the buffer (like the terminfo ones), read in place
+struct bytebuffer_seg {
+  const char *ref;
+  int off;
+  int len;
+};
+
 struct bytebuffer {
   char *buf;
   int len;
   int cap;
+  struct bytebuffer_seg *segs; // in order, only once something was appended by reference
+  int nsegs;
+  int segcap;
+  uint64_t written; // bytes written out so far
+  uint64_t writes;  // write calls that took them
 };
 
+// strings up to this long are cheaper to copy than to give their own iovec.
+// that keeps sgr0 and the attribute strings on the copy path, see the attrs
+// run of the bench
+#ifndef BYTEBUFFER_COPY_MAX
+#define BYTEBUFFER_COPY_MAX 16
+#endif
+
+// iovecs handed to a single writev()
+#if defined(IOV_MAX) && IOV_MAX < 64
+#define BYTEBUFFER_IOV IOV_MAX
+#else
+#define BYTEBUFFER_IOV 64
+#endif
+
 static void bytebuffer_reserve(struct bytebuffer *b, int cap) {
   if (b->cap >= cap) {
     return;
@@ -23,6 +50,11 @@ static void bytebuffer_init(struct bytebuffer *b, int cap) {
   b->cap = 0;
   b->len = 0;
   b->buf = 0;
+  b->segs = 0;
+  b->nsegs = 0;
+  b->segcap = 0;
+  b->written = 0;
+  b->writes = 0;
 
   if (cap > 0) {
     b->cap = cap;
@@ -33,18 +65,75 @@ static void bytebuffer_init(struct bytebuffer *b, int cap) {
 static void bytebuffer_free(struct bytebuffer *b) {
   if (b->buf)
     free(b->buf);
+  free(b->segs);
 }
 
 static void bytebuffer_clear(struct bytebuffer *b) {
   b->len = 0;
+  b->nsegs = 0;
+}
+
+static void bytebuffer_push_seg(struct bytebuffer *b, const char *ref, int off, int len) {
+  if (b->nsegs == b->segcap) {
+    b->segcap = b->segcap ? b->segcap * 2 : 16;
+    b->segs = realloc(b->segs, sizeof(struct bytebuffer_seg) * b->segcap);
+  }
+
+  b->segs[b->nsegs].ref = ref;
+  b->segs[b->nsegs].off = off;
+  b->segs[b->nsegs].len = len;
+  b->nsegs++;
 }
 
 static void bytebuffer_append(struct bytebuffer *b, const char *data, int len) {
   bytebuffer_reserve(b, b->len + len);
   memcpy(b->buf + b->len, data, len);
+
+  if (b->nsegs) {
+    struct bytebuffer_seg *last = &b->segs[b->nsegs - 1];
+    if (!last->ref && last->off + last->len == b->len)
+      last->len += len;
+    else
+      bytebuffer_push_seg(b, 0, b->len, len);
+  }
+
   b->len += len;
 }
 
+// queues 'len' bytes of 'str' without copying them, unless that's cheaper.
+// 'str' must stay untouched until they're written
+static void bytebuffer_append_ref(struct bytebuffer *b, const char *str, int len) {
+  if (len <= BYTEBUFFER_COPY_MAX) {
+    bytebuffer_append(b, str, len);
+    return;
+  }
+
+  // what's queued so far becomes the first piece
+  if (!b->nsegs && b->len > 0)
+    bytebuffer_push_seg(b, 0, 0, b->len);
+
+  bytebuffer_push_seg(b, str, 0, len);
+}
+
+// bytes queued and not written yet
+static int bytebuffer_pending(const struct bytebuffer *b) {
+  int i, n = 0;
+
+  if (!b->nsegs)
+    return b->len;
+
+  for (i = 0; i < b->nsegs; i++)
+    n += b->segs[i].len;
+  return n;
+}
+
+// takes back the last n bytes appended, which must have been copied
+static void bytebuffer_unappend(struct bytebuffer *b, int n) {
+  b->len -= n;
+  if (b->nsegs && (b->segs[b->nsegs - 1].len -= n) == 0)
+    b->nsegs--;
+}
+
 static void bytebuffer_puts(struct bytebuffer *b, const char *str) {
   bytebuffer_append(b, str, strlen(str));
 }
@@ -56,13 +145,6 @@ static void bytebuffer_resize(struct bytebuffer *b, int len) {
 }
 */
 
-static void bytebuffer_flush(struct bytebuffer *b, int fd) {
-  int unused __attribute__((unused));
-  unused = write(fd, b->buf, b->len);
-  bytebuffer_clear(b);
-}
-
-/*
 static void bytebuffer_truncate(struct bytebuffer *b, int n) {
   if (n <= 0)
     return;
@@ -72,4 +154,129 @@ static void bytebuffer_truncate(struct bytebuffer *b, int n) {
   memmove(b->buf, b->buf+n, nmove);
   b->len -= n;
 }
-*/
\ No newline at end of file
+
+// writes as much as the fd takes right now, keeping whatever is left for
+// the next call. returns the number of bytes left, or -1 if the fd is gone
+// (then the buffer is dropped, there's nowhere to send it)
+static int bytebuffer_flush_segs(struct bytebuffer *b, int fd);
+
+static int bytebuffer_flush(struct bytebuffer *b, int fd) {
+  int n;
+
+  if (b->nsegs)
+    return bytebuffer_flush_segs(b, fd);
+
+  while (b->len > 0) {
+    n = write(fd, b->buf, b->len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      break;
+    if (n <= 0) {
+      bytebuffer_clear(b);
+      return -1;
+    }
+    b->written += n;
+    b->writes++;
+    bytebuffer_truncate(b, n);
+  }
+
+  return b->len;
+}
+
+// moves the copied bytes still queued to the front of buf, dropping the ones
+// already written. otherwise frames appended while the terminal lags behind
+// would keep growing buf, since len only goes back to 0 once all is out
+static void bytebuffer_compact(struct bytebuffer *b) {
+  int i, start = b->len;
+
+  for (i = 0; i < b->nsegs; i++) {
+    if (!b->segs[i].ref) {
+      start = b->segs[i].off; // the pieces are in order
+      break;
+    }
+  }
+
+  if (start == 0)
+    return;
+
+  memmove(b->buf, b->buf + start, b->len - start);
+  b->len -= start;
+  for (; i < b->nsegs; i++) {
+    if (!b->segs[i].ref)
+      b->segs[i].off -= start;
+  }
+}
+
+// the same with writev(), once there are pieces to gather
+static int bytebuffer_flush_segs(struct bytebuffer *b, int fd) {
+  struct iovec iov[BYTEBUFFER_IOV];
+  struct bytebuffer_seg *seg;
+  int i, cnt, done;
+  ssize_t n;
+
+  while (b->nsegs > 0) {
+    cnt = b->nsegs < BYTEBUFFER_IOV ? b->nsegs : BYTEBUFFER_IOV;
+    for (i = 0; i < cnt; i++) {
+      seg = &b->segs[i];
+      iov[i].iov_base = (char*)(seg->ref ? seg->ref : b->buf) + seg->off;
+      iov[i].iov_len = seg->len;
+    }
+
+    n = writev(fd, iov, cnt);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      break;
+    if (n <= 0) {
+      bytebuffer_clear(b);
+      return -1;
+    }
+    b->written += n;
+    b->writes++;
+
+    // drop what went out, the piece it stopped in keeps its tail
+    for (done = 0; done < b->nsegs && n >= b->segs[done].len; done++)
+      n -= b->segs[done].len;
+    if (n > 0) {
+      b->segs[done].off += n;
+      b->segs[done].len -= n;
+    }
+    b->nsegs -= done;
+    memmove(b->segs, b->segs + done, sizeof(struct bytebuffer_seg) * b->nsegs);
+  }
+
+  if (b->nsegs) {
+    bytebuffer_compact(b);
+    return bytebuffer_pending(b);
+  }
+
+  b->len = 0; // all out, back to one flat piece
+  return 0;
+}
+
+// same, but waits for the fd until everything is out
+static int bytebuffer_flush_all(struct bytebuffer *b, int fd) {
+  fd_set fds;
+  int n;
+
+  while ((n = bytebuffer_flush(b, fd)) > 0) {
+    FD_ZERO(&fds);
+    FD_SET(fd, &fds);
+    if (select(fd + 1, 0, &fds, 0, 0) < 0 && errno != EINTR) {
+      bytebuffer_clear(b);
+      return -1;
+    }
+  }
+
+  return n;
+}
+
+static void bytebuffer_erase(struct bytebuffer *b, int at, int n) {
+  if (at + n > b->len)
+    n = b->len - at;
+  if (n <= 0)
+    return;
+  memmove(b->buf+at, b->buf+at+n, b->len - at - n);
+  b->len -= n;
+}
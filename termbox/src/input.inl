@@ -11,23 +11,113 @@ static bool starts_with(const char *s1, int len, const char *s2) {
   return *s2 == 0;
 }
 
+//----------------------------------------------------------------------
+// key sequence trie
+//----------------------------------------------------------------------
+
+// built once at init from the 'keys' table, so matching an escape sequence
+// is a single walk over its bytes instead of a starts_with per key
+
+#define KEY_TRIE_MAX 512
+
+struct key_node {
+  char byte;
+  int16_t child; // first node one byte deeper, -1 if none
+  int16_t next;  // next node at the same depth, -1 if none
+  int16_t key;   // index in keys of the sequence ending here, -1 if none
+};
+
+static struct key_node key_trie[KEY_TRIE_MAX];
+static int key_trie_len = 0;
+
+static int key_trie_node(char byte) {
+  struct key_node *node = &key_trie[key_trie_len];
+  node->byte  = byte;
+  node->child = node->next = node->key = -1;
+  return key_trie_len++;
+}
+
+// inserts keys[i]. existing entries win, so call it for the preferred table first
+static void key_trie_insert(const char *str, int key) {
+  int n = 0, c;
+
+  if (!str || !*str) return;
+
+  for (; *str; str++) {
+    for (c = key_trie[n].child; c != -1; c = key_trie[c].next) {
+      if (key_trie[c].byte == *str) break;
+    }
+
+    if (c == -1) {
+      if (key_trie_len >= KEY_TRIE_MAX) return;
+      c = key_trie_node(*str);
+      key_trie[c].next = key_trie[n].child;
+      key_trie[n].child = c;
+    }
+
+    n = c;
+  }
+
+  if (key_trie[n].key == -1)
+    key_trie[n].key = key;
+}
+
+static void init_key_trie(void) {
+  int i;
+
+  key_trie_len = 0;
+  key_trie_node(0); // root
+
+  for (i = 0; i < TB_KEYS_NUM; i++)
+    key_trie_insert(keys[i], i);
+
+  // sequences the terminal sends outside keypad mode, or that terminfo lacks
+  if (builtin_keys && builtin_keys != keys) {
+    for (i = 0; i < TB_KEYS_NUM; i++)
+      key_trie_insert(builtin_keys[i], i);
+  }
+}
+
+// finds the longest key sequence that seq starts with. returns its length
+// and stores its index in 'key', or returns 0 if there is none
+static int key_trie_match(const char *seq, int len, int *key) {
+  int n = 0, c, i, matched = 0;
+
+  for (i = 0; i < len; i++) {
+    for (c = key_trie[n].child; c != -1; c = key_trie[c].next) {
+      if (key_trie[c].byte == seq[i]) break;
+    }
+
+    if (c == -1) break;
+    n = c;
+
+    if (key_trie[n].key != -1) {
+      *key = key_trie[n].key;
+      matched = i + 1;
+    }
+  }
+
+  return matched;
+}
 
 #ifdef __linux__
 
 #include <time.h>
 
+typedef struct timespec timestamp;
+
 struct click {
   int type;
   int x;
   int y;
-  struct timespec ts;
+  timestamp ts;
 };
 
-static void get_time(struct timespec * ts) {
+static void get_time(timestamp * ts) {
   clock_gettime(CLOCK_MONOTONIC, ts);
 }
 
-static double get_timediff(struct timespec start) {
+static double get_timediff(timestamp start) {
   struct timespec end = { 0, 0 };
   get_time(&end);
 
@@ -39,18 +129,20 @@ static double get_timediff(struct timespec start) {
 
 #include <time.h>
 
+typedef struct timeval timestamp;
+
 struct click {
   int type;
   int x;
   int y;
-  struct timeval ts;
+  timestamp ts;
 };
 
-static void get_time(struct timeval * ts) {
+static void get_time(timestamp * ts) {
   gettimeofday(ts, NULL);
 }
 
-static double get_timediff(struct timeval start) {
+static double get_timediff(timestamp start) {
   struct timeval end = { 0, 0 };
   get_time(&end);
 
@@ -411,13 +503,11 @@ static int parse_esc_seq(struct tb_event *event, const char *seq, int len) {
     return 1;
   }
 
-  int i;
-  for (i = TB_KEYS_NUM-1; i >= 0; i--) {
-    if (starts_with(seq, len, keys[i])) {
-      event->ch = 0;
-      event->key = 0xFFFF-i;
-      return 1; // strlen(keys[i]);
-    }
+  int key;
+  if (key_trie_match(seq, len, &key) > 0) {
+    event->ch = 0;
+    event->key = 0xFFFF-key;
+    return 1;
   }
 
   int last, num;
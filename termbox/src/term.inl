@@ -96,47 +96,74 @@ static struct term {
 static bool init_from_terminfo = false;
 static const char **keys;
 static const char **funcs;
+
+// the terminfo file, mapped until shutdown. keys and funcs point into it
+static char *terminfo_data;
+static size_t terminfo_size;
+static int funcs_len[T_FUNCS_NUM]; // measured once, output is on the hot path
 static const char * term_name;
 
+/* optional sequences tb_render() may use for runs of the same cell. only a
+ * terminfo entry that has them turns them on, the builtin tables also stand
+ * in for terminals that merely look alike */
+#define TERM_ECH 0x01 // erase chars, in the current background (bce)
+#define TERM_REP 0x02 // repeat the last char
+static int term_caps = 0;
+
+/* built-in keys of the terminal, also matched when keys come from terminfo */
+static const char **builtin_keys;
+
 static int try_compatible(const char *term, const char *name,
-        const char **tkeys, const char **tfuncs) {
+        const char **tkeys, const char **tfuncs,
+        const char ***out_keys, const char ***out_funcs) {
   if (strstr(term, name)) {
-    keys = tkeys;
-    funcs = tfuncs;
+    *out_keys = tkeys;
+    *out_funcs = tfuncs;
     return 0;
   }
 
   return EUNSUPPORTED_TERM;
 }
 
-static int init_term_builtin(void) {
+static int find_term_builtin(const char *term, const char ***out_keys, const char ***out_funcs) {
   int i;
+
+  for (i = 0; terms[i].name; i++) {
+    if (!strcmp(terms[i].name, term)) {
+      *out_keys = terms[i].keys;
+      *out_funcs = terms[i].funcs;
+      return 0;
+    }
+  }
+
+  /* let's do some heuristic, maybe it's a compatible terminal */
+  if (try_compatible(term, "xterm", xterm_keys, xterm_funcs, out_keys, out_funcs) == 0)
+    return 0;
+  if (try_compatible(term, "rxvt", rxvt_unicode_keys, rxvt_unicode_funcs, out_keys, out_funcs) == 0)
+    return 0;
+  if (try_compatible(term, "linux", linux_keys, linux_funcs, out_keys, out_funcs) == 0)
+    return 0;
+  if (try_compatible(term, "Eterm", eterm_keys, eterm_funcs, out_keys, out_funcs) == 0)
+    return 0;
+  if (try_compatible(term, "screen", screen_keys, screen_funcs, out_keys, out_funcs) == 0)
+    return 0;
+  /* let's assume that 'cygwin' is xterm compatible */
+  if (try_compatible(term, "cygwin", xterm_keys, xterm_funcs, out_keys, out_funcs) == 0)
+    return 0;
+
+  return EUNSUPPORTED_TERM;
+}
+
+static int init_term_builtin(void) {
   const char *term = getenv("TERM");
 
   if (term) {
     term_name = term;
-    for (i = 0; terms[i].name; i++) {
-      if (!strcmp(terms[i].name, term)) {
-        keys = terms[i].keys;
-        funcs = terms[i].funcs;
-        return 0;
-      }
-    }
-
-    /* let's do some heuristic, maybe it's a compatible terminal */
-    if (try_compatible(term, "xterm", xterm_keys, xterm_funcs) == 0)
-      return 0;
-    if (try_compatible(term, "rxvt", rxvt_unicode_keys, rxvt_unicode_funcs) == 0)
-      return 0;
-    if (try_compatible(term, "linux", linux_keys, linux_funcs) == 0)
-      return 0;
-    if (try_compatible(term, "Eterm", eterm_keys, eterm_funcs) == 0)
-      return 0;
-    if (try_compatible(term, "screen", screen_keys, screen_funcs) == 0)
-      return 0;
-    /* let's assume that 'cygwin' is xterm compatible */
-    if (try_compatible(term, "cygwin", xterm_keys, xterm_funcs) == 0)
+    if (find_term_builtin(term, &keys, &funcs) == 0) {
+      builtin_keys = keys;
+      term_caps = 0;
       return 0;
+    }
   }
 
   return EUNSUPPORTED_TERM;
@@ -162,46 +189,64 @@ static bool detect_color_support() {
 // terminfo
 //----------------------------------------------------------------------
 
-static char *read_file(const char *file) {
-  FILE *f = fopen(file, "rb");
-  if (!f)
+static char *map_file(const char *file) {
+  int fd = open(file, O_RDONLY);
+  if (fd < 0)
     return 0;
 
   struct stat st;
-  if (fstat(fileno(f), &st) != 0) {
-    fclose(f);
-    return 0;
-  }
-
-  char *data = malloc(st.st_size);
-  if (!data) {
-    fclose(f);
+  if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+    close(fd);
     return 0;
   }
 
-  if (fread(data, 1, st.st_size, f) != (size_t)st.st_size) {
-    fclose(f);
-    free(data);
+  char *data = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
     return 0;
-  }
 
-  fclose(f);
+  terminfo_size = st.st_size;
   return data;
 }
 
+static char terminfo_path[4096]; // where load_terminfo() found it
+
+// the paths load_terminfo() tried before terminfo_path, each NUL terminated.
+// if any of them shows up later, it takes precedence over terminfo_path
+static char terminfo_misses[8192];
+static size_t terminfo_misses_len;
+static bool terminfo_misses_full;
+
+static void terminfo_add_miss(const char *path) {
+  size_t len = strlen(path) + 1;
+  if (terminfo_misses_len + len > sizeof(terminfo_misses)) {
+    terminfo_misses_full = true;
+    return;
+  }
+  memcpy(terminfo_misses + terminfo_misses_len, path, len);
+  terminfo_misses_len += len;
+}
+
 static char *terminfo_try_path(const char *path, const char *term) {
   char tmp[4096];
   snprintf(tmp, sizeof(tmp), "%s/%c/%s", path, term[0], term);
   tmp[sizeof(tmp)-1] = '\0';
-  char *data = read_file(tmp);
-  if (data) {
-    return data;
+  char *data = map_file(tmp);
+
+  if (!data) {
+    terminfo_add_miss(tmp);
+
+    // fallback to darwin specific dirs structure
+    snprintf(tmp, sizeof(tmp), "%s/%x/%s", path, term[0], term);
+    tmp[sizeof(tmp)-1] = '\0';
+    data = map_file(tmp);
+    if (!data)
+      terminfo_add_miss(tmp);
   }
 
-  // fallback to darwin specific dirs structure
-  snprintf(tmp, sizeof(tmp), "%s/%x/%s", path, term[0], term);
-  tmp[sizeof(tmp)-1] = '\0';
-  return read_file(tmp);
+  if (data)
+    memcpy(terminfo_path, tmp, sizeof(tmp));
+  return data;
 }
 
 static char *load_terminfo(void) {
@@ -212,6 +257,8 @@ static char *load_terminfo(void) {
   }
 
   term_name = term;
+  terminfo_misses_len = 0;
+  terminfo_misses_full = false;
 
   // if TERMINFO is set, no other directory should be searched
   const char *terminfo = getenv("TERMINFO");
@@ -256,13 +303,29 @@ static char *load_terminfo(void) {
 #define TI_HEADER_LENGTH 12
 #define TB_KEYS_NUM 22
 
-static const char *terminfo_copy_string(char *data, int str, int table) {
-  const int16_t off = *(int16_t*)(data + str);
+static const char *terminfo_keys[TB_KEYS_NUM + 1];
+static const char *terminfo_funcs[T_FUNCS_NUM];
+
+#define TI_BCE 28  // back_color_erase
+#define TI_ECH 37  // erase_chars
+#define TI_REP 121 // repeat_char
+
+// the string at offset 'str', read in place. absent (-1) or cancelled (-2)
+// capabilities, and anything pointing off the file, come out empty
+static const char *terminfo_string(const char *data, int str, int table) {
+  int16_t off;
+
+  if ((size_t)str + sizeof(off) > terminfo_size)
+    return "";
+
+  memcpy(&off, data + str, sizeof(off));
+  if (off < 0 || (size_t)(table + off) >= terminfo_size)
+    return "";
+
   const char *src = data + table + off;
-  int len = strlen(src);
-  char *dst = malloc(len+1);
-  strcpy(dst, src);
-  return dst;
+  if (!memchr(src, '\0', terminfo_size - (table + off)))
+    return "";
+  return src;
 }
 
 static const int16_t ti_funcs[] = {
@@ -289,9 +352,16 @@ static const int16_t ti_keys[] = {
 // strings section
 // table section
 
-static void parse_terminfo(char * data) {
+// false if the file is too short for what its header says it holds
+static bool parse_terminfo(const char * data) {
   int i;
-  int16_t *header = (int16_t*)data;
+  int16_t header[TI_HEADER_LENGTH / 2];
+
+  if (terminfo_size < TI_HEADER_LENGTH)
+    return false;
+
+  // the mapping is read-only, and may not be aligned for int16_t
+  memcpy(header, data, sizeof(header));
 
   if ((header[1] + header[2]) % 2) { 
     header[2] += 1; // old quirk to align everything on word boundaries
@@ -315,50 +385,283 @@ static void parse_terminfo(char * data) {
   const int strings_offset = TI_HEADER_LENGTH + namesSize + boolsSize + (numWidth * numCount);
   const int table_offset   = strings_offset + (2 * strOffCount);
 
-  keys  = malloc(sizeof(const char*) * (TB_KEYS_NUM + 1));
-  funcs = malloc(sizeof(const char*) * T_FUNCS_NUM);
+  // everything up to the string table, bools included, has to be there
+  if ((size_t)table_offset > terminfo_size)
+    return false;
+
+  keys  = terminfo_keys;
+  funcs = terminfo_funcs;
 
   for (i = 0; i < TB_KEYS_NUM; i++) {
-    keys[i] = terminfo_copy_string(data, strings_offset + 2 * ti_keys[i], table_offset);
+    keys[i] = ti_keys[i] < strOffCount
+      ? terminfo_string(data, strings_offset + 2 * ti_keys[i], table_offset) : "";
   }
 
   // the last two entries are reserved for mouse. because the table offset is
   // not there, the two entries have to fill in manually
   for (i = 0; i < T_FUNCS_NUM-2; i++) {
-    funcs[i] = terminfo_copy_string(data, strings_offset + 2 * ti_funcs[i], table_offset);
+    funcs[i] = ti_funcs[i] < strOffCount
+      ? terminfo_string(data, strings_offset + 2 * ti_funcs[i], table_offset) : "";
   }
 
   keys[TB_KEYS_NUM] = 0;
   funcs[T_FUNCS_NUM-2] = ENTER_MOUSE_SEQ;
   funcs[T_FUNCS_NUM-1] = EXIT_MOUSE_SEQ;
+
+  // only their presence matters, the sequences themselves are the ansi ones
+  bool bce = boolsSize > TI_BCE && data[TI_HEADER_LENGTH + namesSize + TI_BCE] == 1;
+
+  term_caps = 0;
+  if (bce && strOffCount > TI_ECH && *terminfo_string(data, strings_offset + 2 * TI_ECH, table_offset))
+    term_caps |= TERM_ECH;
+  if (strOffCount > TI_REP && *terminfo_string(data, strings_offset + 2 * TI_REP, table_offset))
+    term_caps |= TERM_REP;
+
+  return true;
 }
 
-static int init_term(void) {
-  char *data = load_terminfo();
-  if (!data) {
-    init_from_terminfo = false;
-    return init_term_builtin();
+// only funcs, the keys are never sent: they go into the input trie once at
+// init, where measuring them ahead would save nothing
+static void measure_funcs(void) {
+  int i;
+  for (i = 0; i < T_FUNCS_NUM; i++)
+    funcs_len[i] = strlen(funcs[i]);
+}
+
+//----------------------------------------------------------------------
+// terminfo cache
+//----------------------------------------------------------------------
+
+// what parse_terminfo() took from a terminfo file, kept in
+// $XDG_CACHE_HOME/termbox/$TERM (or ~/.cache/termbox/$TERM) so later starts
+// skip the search. the header is followed by the source's path, the
+// TERMINFO, TERMINFO_DIRS and HOME it was found with, the paths searched
+// before it and an empty string, the keys and the funcs but the mouse ones,
+// all NUL terminated. it's only valid while the source file is the same
+// one, unchanged, and none of the paths before it has appeared since
+
+#define TI_CACHE_MAGIC 0x74626332 // "tbc2"
+
+struct terminfo_cache {
+  uint32_t magic;
+  int32_t caps;
+  int64_t mtime; // ns
+  int64_t size;
+  int64_t ino;
+};
+
+// with ns where there are, so an edit in the same second still shows
+static int64_t file_mtime(const struct stat *st) {
+#ifdef __linux__
+  return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+#else
+  return (int64_t)st->st_mtime * 1000000000;
+#endif
+}
+
+static bool terminfo_cache_path(char *path, size_t len, bool create) {
+  const char *term = getenv("TERM");
+  const char *cache = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  char dir[4096];
+  int n;
+
+  if (!term || !*term || strchr(term, '/'))
+    return false;
+
+  if (cache && *cache)
+    n = snprintf(dir, sizeof(dir), "%s/termbox", cache);
+  else if (home && *home)
+    n = snprintf(dir, sizeof(dir), "%s/.cache/termbox", home);
+  else
+    return false;
+  if (n < 0 || (size_t)n >= sizeof(dir))
+    return false;
+
+  if (create) {
+    // the parent first, ~/.cache may not be there yet
+    *strrchr(dir, '/') = '\0';
+    mkdir(dir, 0700);
+    strcat(dir, "/termbox");
+    mkdir(dir, 0700);
+  }
+
+  n = snprintf(path, len, "%s/%s", dir, term);
+  return n >= 0 && (size_t)n < len;
+}
+
+static void terminfo_cache_env(char *env, size_t len) {
+  const char *terminfo = getenv("TERMINFO");
+  const char *dirs = getenv("TERMINFO_DIRS");
+  const char *home = getenv("HOME");
+  snprintf(env, len, "%s\n%s\n%s", terminfo ? terminfo : "", dirs ? dirs : "",
+           home ? home : "");
+}
+
+// the next string in the cache, or NULL past its end
+static const char *terminfo_cache_string(const char **p, const char *end) {
+  const char *str = *p;
+  if (str >= end)
+    return 0;
+  *p += strlen(str) + 1; // the last byte is checked to be a NUL
+  return str;
+}
+
+// checks a mapped cache and takes the keys, funcs and caps from it
+static bool parse_terminfo_cache(const char *data) {
+  struct terminfo_cache hdr;
+  struct stat st;
+  char env[4096];
+  const char *p, *end, *source, *cached_env, *miss;
+  int i;
+
+  if (terminfo_size < sizeof(hdr) || data[terminfo_size - 1] != '\0')
+    return false;
+
+  memcpy(&hdr, data, sizeof(hdr));
+  p = data + sizeof(hdr);
+  end = data + terminfo_size;
+
+  source = terminfo_cache_string(&p, end);
+  cached_env = terminfo_cache_string(&p, end);
+  terminfo_cache_env(env, sizeof(env));
+
+  if (hdr.magic != TI_CACHE_MAGIC || !source || !cached_env || strcmp(env, cached_env) != 0)
+    return false;
+
+  // one stat() instead of the whole search
+  if (stat(source, &st) != 0 || file_mtime(&st) != hdr.mtime ||
+      st.st_size != hdr.size || (int64_t)st.st_ino != hdr.ino)
+    return false;
+
+  // a file that now comes first in the search would have been picked
+  while ((miss = terminfo_cache_string(&p, end)) && *miss) {
+    if (stat(miss, &st) == 0)
+      return false;
   }
+  if (!miss)
+    return false;
+
+  for (i = 0; i < TB_KEYS_NUM; i++) {
+    if (!(terminfo_keys[i] = terminfo_cache_string(&p, end)))
+      return false;
+  }
+  for (i = 0; i < T_FUNCS_NUM-2; i++) {
+    if (!(terminfo_funcs[i] = terminfo_cache_string(&p, end)))
+      return false;
+  }
+
+  keys = terminfo_keys;
+  funcs = terminfo_funcs;
+  keys[TB_KEYS_NUM] = 0;
+  funcs[T_FUNCS_NUM-2] = ENTER_MOUSE_SEQ;
+  funcs[T_FUNCS_NUM-1] = EXIT_MOUSE_SEQ;
+  term_caps = hdr.caps;
+  return true;
+}
+
+// points keys and funcs into the cache for $TERM, if there's a valid one
+static bool load_terminfo_cache(void) {
+  char path[4096];
+
+  if (!terminfo_cache_path(path, sizeof(path), false))
+    return false;
+
+  char *data = map_file(path);
+  if (!data)
+    return false;
+
+  if (!parse_terminfo_cache(data)) {
+    munmap(data, terminfo_size);
+    return false;
+  }
+
+  term_name = getenv("TERM");
+  terminfo_data = data;
+  return true;
+}
+
+// writes what was just parsed from terminfo_path. failing is fine, the
+// next start just searches again
+static void save_terminfo_cache(void) {
+  struct terminfo_cache hdr;
+  struct stat st;
+  char path[4096], tmp[4200], env[4096];
+  FILE *f;
+  bool ok;
+  int i;
+
+  if (terminfo_misses_full || !terminfo_cache_path(path, sizeof(path), true) ||
+      stat(terminfo_path, &st) != 0)
+    return;
+
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = TI_CACHE_MAGIC;
+  hdr.caps = term_caps;
+  hdr.mtime = file_mtime(&st);
+  hdr.size = st.st_size;
+  hdr.ino = st.st_ino;
+  terminfo_cache_env(env, sizeof(env));
+
+  // written aside and renamed over, so nobody reads half of it
+  snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+  f = fopen(tmp, "wb");
+  if (!f)
+    return;
+
+  fwrite(&hdr, sizeof(hdr), 1, f);
+  fwrite(terminfo_path, strlen(terminfo_path) + 1, 1, f);
+  fwrite(env, strlen(env) + 1, 1, f);
+  fwrite(terminfo_misses, terminfo_misses_len, 1, f);
+  fputc('\0', f);
+  for (i = 0; i < TB_KEYS_NUM; i++)
+    fwrite(keys[i], strlen(keys[i]) + 1, 1, f);
+  for (i = 0; i < T_FUNCS_NUM-2; i++)
+    fwrite(funcs[i], strlen(funcs[i]) + 1, 1, f);
+
+  ok = !ferror(f);
+  if (fclose(f) != 0 || !ok || rename(tmp, path) != 0)
+    unlink(tmp);
+}
+
+// headless runs (benchmarks, replays) may use the cache but leave none behind
+static int init_term(bool save_cache) {
+  if (load_terminfo_cache()) {
+    init_from_terminfo = true;
+  } else {
+    char *data = load_terminfo();
+    if (data && !parse_terminfo(data)) {
+      munmap(data, terminfo_size);
+      data = 0;
+    }
+
+    if (!data) {
+      init_from_terminfo = false;
+      if (init_term_builtin() != 0)
+        return EUNSUPPORTED_TERM;
+      measure_funcs();
+      return 0;
+    }
+
+    init_from_terminfo = true;
+    terminfo_data = data;
+    if (save_cache)
+      save_terminfo_cache();
+  }
+
+  measure_funcs();
+
+  const char **unused_funcs;
+  if (find_term_builtin(term_name, &builtin_keys, &unused_funcs) != 0)
+    builtin_keys = 0;
 
-  parse_terminfo(data);
-  init_from_terminfo = true;
-  free(data);
   return 0;
 }
 
 static void shutdown_term(void) {
   if (init_from_terminfo) {
-    int i;
-    for (i = 0; i < TB_KEYS_NUM; i++) {
-      free((void*)keys[i]);
-    }
-    // the last two entries are reserved for mouse. because the table offset
-    // is not there, the two entries have to fill in manually and do not
-    // need to be freed.
-    for (i = 0; i < T_FUNCS_NUM-2; i++) {
-      free((void*)funcs[i]);
-    }
-    free(keys);
-    free(funcs);
+    munmap(terminfo_data, terminfo_size);
+    terminfo_data = 0;
+    init_from_terminfo = false;
   }
 }
@@ -11,26 +11,71 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <limits.h>
+#include <ctype.h>
 #include <sys/select.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/time.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include <unistd.h>
-#include <wchar.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "termbox.h"
 #include "bytebuffer.inl"
 #include "term.inl"
 #include "input.inl"
 
+// columns [min, max] of a row, empty when min > max
+struct span {
+  int min;
+  int max;
+};
+
 struct cellbuf {
   int width;
   int height;
+#ifdef WITH_SOA_CELLS
+  tb_chr *chs; // one plane per field, so rows compare as flat arrays
+  tb_color *fgs;
+  tb_color *bgs;
+  struct tb_cell *view; // packed copy handed out by tb_cell_buffer()
+#else
   struct tb_cell *cells;
+#endif
+  uint8_t *widths; // per cell, columns taken by its char
+  int *wide_count; // per row, cells holding a wide char
+  struct span *dirty; // per row, cells written since the last render
+  struct span *used; // per row, cells written since the last clear, layers only
+};
+
+struct tb_sprite {
+  struct cellbuf buf;
 };
 
-#define CELL(buf, x, y) (buf)->cells[(y) * (buf)->width + (x)]
+#define CELL_AT(buf, x, y) ((y) * (buf)->width + (x))
+
+#ifdef WITH_SOA_CELLS
+#define CELL_CH(buf, i) (buf)->chs[i]
+#define CELL_FG(buf, i) (buf)->fgs[i]
+#define CELL_BG(buf, i) (buf)->bgs[i]
+#else
+#define CELL_CH(buf, i) (buf)->cells[i].ch
+#define CELL_FG(buf, i) (buf)->cells[i].fg
+#define CELL_BG(buf, i) (buf)->cells[i].bg
+#endif
 #define IS_CURSOR_HIDDEN(cx, cy) (cx == -1 || cy == -1)
 #define LAST_COORD_INIT -1
 
@@ -44,6 +89,9 @@ static struct bytebuffer input_buffer;
 #define MAX_LIMIT 512
 static char print_buf[MAX_LIMIT];
 
+#define INPUT_CHUNK 1024 // bytes asked from the tty per read
+#define OUTPUT_PENDING_MAX (256 * 1024) // queued output before tb_render() waits for the tty
+
 static int termw = -1;
 static int termh = -1;
 
@@ -51,10 +99,56 @@ static bool title_set = false;
 static int initflags = TB_INIT_ALL;
 
 static int inout;
+static int inout_flags; // file status flags to restore, output is non-blocking
+static bool headless = false; // inout isn't a terminal, see tb_init_headless()
 static int winch_fds[2];
 
+/* set when tb_render() had to skip a frame, see TB_INIT_DROP_FRAMES */
+static bool frame_skipped = false;
+
+/* set when tb_peek_events() hit an error after it had events to return */
+static bool peek_error = false;
+
+/* see tb_get_stats(), the last frame's counters and the running totals */
+static struct tb_stats frame_stats, total_stats;
+
+/* whether the terminal takes synchronized updates (mode 2026), which
+ * tb_render() wraps each frame in so it shows up all at once */
+static bool sync_output = false;
+#define SYNC_BEGIN "\033[?2026h"
+#define SYNC_END   "\033[?2026l"
+#define SYNC_QUERY_TIME 0.5 // how long to wait for the terminal to answer
+
+#ifdef __linux__
+static int epoll_fd = -1;
+static int tick_fd = -1;
+static bool epoll_out = false; // whether inout is watched for EPOLLOUT too
+#else
+static int tick_interval = 0;
+static struct timeval tick_next;
+#endif
+
+/* where the terminal's cursor is, or LAST_COORD_INIT when unknown */
 static int lastx = LAST_COORD_INIT;
 static int lasty = LAST_COORD_INIT;
+
+/* the attributes last sent, see set_colors() */
+static tb_color lastfg = LAST_ATTR_INIT, lastbg = LAST_ATTR_INIT;
+static int lastattrs;
+
+/* what set_colors() sent for recent color changes, so repeating one is a
+ * single copy. direct-mapped on the (from, to) pairs */
+#define SGR_CACHE_SIZE 64 // entries, a power of two
+#define SGR_CACHE_SEQ  46 // longest sequence kept
+struct sgr_cache_entry {
+  tb_color fromfg, frombg, fg, bg;
+  uint8_t used;
+  uint8_t attrs;
+  uint8_t len;
+  char seq[SGR_CACHE_SEQ];
+};
+static struct sgr_cache_entry sgr_cache[SGR_CACHE_SIZE];
+
 static int cursor_x = -1;
 static int cursor_y = -1;
 
@@ -62,23 +156,79 @@ static int output_mode = TB_OUTPUT_NORMAL;
 static tb_color background = TB_DEFAULT;
 static tb_color foreground = TB_DEFAULT;
 
+/* a single row of blank cells in the clear attributes, copied over rows
+ * being cleared. rebuilt when the attributes or the width change */
+static struct cellbuf blank_row;
+static int blank_row_stale = 1;
+
+/* layers drawn above the back buffer, see tb_select_layer(). their cells
+ * start out as ch 0, which lets the layers below show through. once any
+ * exist, tb_render() composites them into comp_buffer and diffs that */
+static struct cellbuf layers[TB_MAX_LAYERS - 1];
+static struct cellbuf comp_buffer;
+static struct cellbuf empty_row; // a row of transparent cells
+static int num_layers = 1;
+static int cur_layer = 0;
+
 static void write_cursor(int x, int y);
 static void write_title(const char * title);
 
+static bool cellbuf_alloc(struct cellbuf *buf, int width, int height);
 static void cellbuf_init(struct cellbuf *buf, int width, int height);
 static void cellbuf_resize(struct cellbuf *buf, int width, int height);
 static void cellbuf_clear(struct cellbuf *buf);
 static void cellbuf_free(struct cellbuf *buf);
+static void cellbuf_touch_all(struct cellbuf *buf);
+static void cellbuf_clean_row(struct cellbuf *buf, int y);
+static void cellbuf_touch(struct cellbuf *buf, int x0, int x1, int y);
+static void cellbuf_copy_cells(struct cellbuf *dst, int dx, int dy,
+                               const struct cellbuf *src, int sx, int sy, int n);
+static void update_blank_row(int width);
+static const struct cellbuf *clear_row_for(const struct cellbuf *buf);
+static void layer_clear(struct cellbuf *buf);
+static int dirty_span(int y, int *x0, int *x1);
+static void composite_row(int y, int x0, int x1);
+static void cellbuf_measure_row(struct cellbuf *buf, int y);
+static void take_exposed_cells(void);
+static int cellbuf_row_diff(struct cellbuf *a, struct cellbuf *b, int row, int x, int end);
+#ifdef WITH_SOA_CELLS
+static void cellbuf_pack(struct cellbuf *buf);
+static void cellbuf_unpack(struct cellbuf *buf);
+#endif
 
 static void update_term_size(void);
 static void set_colors(tb_color fg, tb_color bg);
-static void send_char(int x, int y, uint32_t c);
+static void send_char(int x, int y, uint32_t c, int w);
+static int run_length(struct cellbuf *buf, int row, int x, int end);
+static void send_run(int x, int y, uint32_t c, int n);
 static void sigwinch_handler(int xxx);
-static int wait_fill_event(struct tb_event *event, struct timeval *timeout);
+static int init_event_loop(void);
+static void shutdown_event_loop(void);
+static int wait_fill_event(struct tb_event *event, int timeout);
+static int extract_event(struct tb_event *event);
+static bool query_sync_output(void);
 
 /* may happen in a different thread */
 static volatile int buffer_size_change_request;
 
+/* where tb_cell() and friends write to, see tb_select_sprite() and
+ * tb_select_layer() */
+static struct cellbuf *draw_buf = &back_buffer;
+
+/* set by tb_cell_buffer(), widths must be recomputed on next render */
+static int cells_exposed = 0;
+
+// queues one of the terminal's sequences, which stay put until shutdown
+static inline void put_func(int f) {
+  bytebuffer_append_ref(&output_buffer, funcs[f], funcs_len[f]);
+}
+
+// nothing below the hangul jamo block is wide, so skip the table lookup
+static inline int char_width(tb_chr ch) {
+  if (ch < 0x1100) return 1;
+  return tb_unicode_is_char_wide(ch) ? 2 : 1;
+}
+
 /* -------------------------------------------------------- */
 
 int tb_init_fd(int inout_) {
@@ -87,16 +237,25 @@ int tb_init_fd(int inout_) {
     return TB_EFAILED_TO_OPEN_TTY;
   }
 
-  if (init_term() < 0) {
+  if (init_term(true) < 0) {
     close(inout);
     return TB_EUNSUPPORTED_TERMINAL;
   }
 
+  init_key_trie();
+
   if (pipe(winch_fds) < 0) {
     close(inout);
     return TB_EPIPE_TRAP_ERROR;
   }
 
+  if (init_event_loop() < 0) {
+    close(inout);
+    close(winch_fds[0]);
+    close(winch_fds[1]);
+    return TB_EEVENT_LOOP_ERROR;
+  }
+
   struct sigaction sa;
   memset(&sa, 0, sizeof(sa));
   sa.sa_handler = sigwinch_handler;
@@ -117,26 +276,62 @@ int tb_init_fd(int inout_) {
   tios.c_cc[VTIME] = 0; // 0ms timeout (unit is tens of second).
 
   tcsetattr(inout, TCSAFLUSH, &tios);
+
+  // a slow terminal must not stall the caller, see bytebuffer_flush()
+  inout_flags = fcntl(inout, F_GETFL);
+  fcntl(inout, F_SETFL, inout_flags | O_NONBLOCK);
+  return 0;
+}
+
+int tb_init_headless(int fd, int w, int h) {
+  inout = fd;
+  if (inout == -1 || w <= 0 || h <= 0) {
+    return TB_EFAILED_TO_OPEN_TTY;
+  }
+
+  if (init_term(false) < 0) {
+    close(inout);
+    return TB_EUNSUPPORTED_TERMINAL;
+  }
+
+  init_key_trie();
+
+  // never written to, but tb_shutdown() closes it like any other
+  if (pipe(winch_fds) < 0) {
+    close(inout);
+    return TB_EPIPE_TRAP_ERROR;
+  }
+
+  // no event loop, no termios and blocking writes, so every frame goes out
+  headless = true;
+  inout_flags = fcntl(inout, F_GETFL);
+  termw = w;
+  termh = h;
   return 0;
 }
 
 int tb_init_screen(int flags) {
-  bytebuffer_init(&input_buffer, 128);
+  bytebuffer_init(&input_buffer, INPUT_CHUNK);
   bytebuffer_init(&output_buffer, 32 * 1024);
+  memset(&frame_stats, 0, sizeof(frame_stats));
+  memset(&total_stats, 0, sizeof(total_stats));
 
   initflags = flags;
 
   if (initflags & TB_INIT_DETECT_MODE)
     output_mode = detect_color_support();
 
+  if ((initflags & TB_INIT_SYNC_OUTPUT) && !headless)
+    sync_output = query_sync_output();
+
   if (initflags & TB_INIT_NO_CURSOR)
     tb_hide_cursor();
 
   if (initflags & TB_INIT_KEYPAD)
-    bytebuffer_puts(&output_buffer, funcs[T_ENTER_KEYPAD]);
+    put_func(T_ENTER_KEYPAD);
 
   if (initflags & TB_INIT_ALTSCREEN) {
-    bytebuffer_puts(&output_buffer, funcs[T_ENTER_CA]);
+    put_func(T_ENTER_CA);
     tb_clear_screen(); // flushes output
   } else {
     bytebuffer_flush(&output_buffer, inout);
@@ -170,6 +365,8 @@ int tb_init(void) {
 }
 
 void tb_shutdown(void) {
+  int i;
+
   if (termw == -1) {
     fputs("term not initialized.", stderr);
     return;
@@ -177,38 +374,66 @@ void tb_shutdown(void) {
 
   if (title_set) write_title("");
   tb_show_cursor();
-  bytebuffer_puts(&output_buffer, funcs[T_SGR0]); // reset attrs
+  put_func(T_SGR0); // reset attrs
+  lastfg = lastbg = LAST_ATTR_INIT;
+  memset(sgr_cache, 0, sizeof(sgr_cache)); // the next terminal may differ
 
   if (initflags & TB_INIT_ALTSCREEN) {
-    bytebuffer_puts(&output_buffer, funcs[T_EXIT_CA]);
+    put_func(T_EXIT_CA);
 
     // don't clear screen by default. if user wants to, he can
     // just call tb_clear_screen() anyway
-    // bytebuffer_puts(&output_buffer, funcs[T_CLEAR_SCREEN]);
+    // put_func(T_CLEAR_SCREEN);
   }
 
   if (initflags & TB_INIT_KEYPAD)
-    bytebuffer_puts(&output_buffer, funcs[T_EXIT_KEYPAD]);
+    put_func(T_EXIT_KEYPAD);
 
-  bytebuffer_puts(&output_buffer, funcs[T_EXIT_MOUSE]);
-  bytebuffer_flush(&output_buffer, inout);
-  tcsetattr(inout, TCSAFLUSH, &orig_tios);
+  put_func(T_EXIT_MOUSE);
+  bytebuffer_flush_all(&output_buffer, inout);
+  if (!headless)
+    tcsetattr(inout, TCSAFLUSH, &orig_tios);
+  fcntl(inout, F_SETFL, inout_flags);
 
   shutdown_term();
   close(inout);
   close(winch_fds[0]);
   close(winch_fds[1]);
+  shutdown_event_loop();
 
   cellbuf_free(&back_buffer);
   cellbuf_free(&front_buffer);
+  cellbuf_free(&blank_row);
+  blank_row.width = 0;
+  blank_row_stale = 1;
+  for (i = 1; i < num_layers; ++i)
+    cellbuf_free(&layers[i - 1]);
+  if (num_layers > 1)
+    cellbuf_free(&comp_buffer);
+  if (empty_row.width > 0)
+    cellbuf_free(&empty_row);
+  empty_row.width = 0;
+  num_layers = 1;
+  cur_layer = 0;
+  draw_buf = &back_buffer;
   bytebuffer_free(&output_buffer);
   bytebuffer_free(&input_buffer);
+  sync_output = false;
+  frame_skipped = false;
+  peek_error = false;
+  headless = false;
   termw = termh = -1;
 }
 
+static uint64_t ns_since(timestamp start) {
+  return (uint64_t)(get_timediff(start) * 1e9);
+}
+
 void tb_render(void) {
-  int x,y,w,i;
-  struct tb_cell *back, *front;
+  int x,y,w,i,k,n,row,start,x0,x1,begin;
+  struct cellbuf *src;
+  uint64_t written, writes;
+  timestamp t;
 
   /* invalidate cursor position */
   lastx = LAST_COORD_INIT;
@@ -217,55 +442,154 @@ void tb_render(void) {
   if (buffer_size_change_request)
     tb_resize();
 
+  // cells may have been written through tb_cell_buffer()
+  if (cells_exposed)
+    take_exposed_cells();
+
+  // the terminal is still busy with the last frame. leave the dirty spans
+  // alone, so the next frame carries these changes too
+  if ((initflags & TB_INIT_DROP_FRAMES) && bytebuffer_pending(&output_buffer) > 0 &&
+      bytebuffer_flush(&output_buffer, inout) > 0) {
+    frame_skipped = true;
+    return;
+  }
+  frame_skipped = false;
+
+  memset(&frame_stats, 0, sizeof(frame_stats));
+  written = output_buffer.written;
+  writes = output_buffer.writes;
+  get_time(&t);
+
+  // with layers in use the screen shows their composite
+  src = (num_layers > 1) ? &comp_buffer : &back_buffer;
+
+  if (sync_output)
+    bytebuffer_append(&output_buffer, SYNC_BEGIN, sizeof(SYNC_BEGIN) - 1);
+  begin = bytebuffer_pending(&output_buffer);
+
   for (y = 0; y < front_buffer.height; ++y) {
-    for (x = 0; x < front_buffer.width; ) {
 
-      // get back and front cells for x/y position
-      back = &CELL(&back_buffer, x, y);
-      front = &CELL(&front_buffer, x, y);
+    // rows nobody wrote to since last time can't differ from the front
+    if (!dirty_span(y, &x0, &x1))
+      continue;
 
-      // get width of char
-      w = wcwidth(back->ch); // tb_unicode_is_char_wide(back->ch) ? 2 : 1;
-      if (w < 1) w = 1;
+    if (num_layers > 1)
+      composite_row(y, x0, x1);
 
-      // if back cell hasn't changed, then skip to next one
-      if (memcmp(back, front, sizeof(struct tb_cell)) == 0) {
-        x += w;
-        continue;
+    row = CELL_AT(src, 0, y);
+
+    // start one cell earlier if a wide char there covers the span's start
+    x = x0;
+    if (x > 0 && src->widths[row + x - 1] == 2)
+      x--;
+    frame_stats.cells_compared += x1 - x + 1;
+
+    while (x <= x1) {
+
+      // skip straight to the next cell that differs from the front
+      start = x;
+      x = cellbuf_row_diff(src, &front_buffer, row, x, x1 + 1);
+      if (x > x1)
+        break;
+
+      // unless it's hidden under a wide char we skipped over
+      if (src->wide_count[y] > 0) {
+        k = x;
+        for (x = start; x < k; x += src->widths[row + x]);
+        if (x > k)
+          continue;
       }
 
+      // get width of char, computed when the cell was written
+      i = row + x;
+      w = src->widths[i];
+
       // copy back cell to front and set attributes
-      memcpy(front, back, sizeof(struct tb_cell));
-      set_colors(back->fg, back->bg);
+      CELL_CH(&front_buffer, i) = CELL_CH(src, i);
+      CELL_FG(&front_buffer, i) = CELL_FG(src, i);
+      CELL_BG(&front_buffer, i) = CELL_BG(src, i);
+      set_colors(CELL_FG(src, i), CELL_BG(src, i));
 
       // if we have a wide char, but x position + char width would exceed screen width
       if (w == 2 && x >= front_buffer.width-1) {
 
-        send_char(x, y, ' ');
+        send_char(x, y, ' ', 1);
+
+      // a run of the same cell may go out as a single REP or ECH
+      } else if (w == 1 && (n = run_length(src, row, x, x1 + 1)) > 1) {
+
+        for (k = 1; k < n; ++k) {
+          CELL_CH(&front_buffer, i + k) = CELL_CH(src, i);
+          CELL_FG(&front_buffer, i + k) = CELL_FG(src, i);
+          CELL_BG(&front_buffer, i + k) = CELL_BG(src, i);
+        }
+        send_run(x, y, CELL_CH(src, i), n);
+        w = n;
 
       // otherwise, if we have a regular char or if there's enough room
       } else {
 
         // then send the char
-        send_char(x, y, back->ch);
+        send_char(x, y, CELL_CH(src, i), w);
 
         // and empty the following cells, if needed (wide char)
-        for (i = 1; i < w; ++i) {
-          front = &CELL(&front_buffer, x + i, y);
-          front->ch = 0;
-          front->fg = back->fg;
-          front->bg = back->bg;
+        for (k = 1; k < w; ++k) {
+          CELL_CH(&front_buffer, i + k) = 0;
+          CELL_FG(&front_buffer, i + k) = CELL_FG(src, i);
+          CELL_BG(&front_buffer, i + k) = CELL_BG(src, i);
         }
       }
 
+      frame_stats.cells_emitted += w;
       x += w;
     }
+
+    cellbuf_clean_row(&back_buffer, y);
+    for (k = 1; k < num_layers; ++k)
+      cellbuf_clean_row(&layers[k - 1], y);
   }
 
   if (!IS_CURSOR_HIDDEN(cursor_x, cursor_y))
     write_cursor(cursor_x, cursor_y);
 
-  bytebuffer_flush(&output_buffer, inout);
+  // an empty frame needs no bracketing
+  if (sync_output) {
+    if (bytebuffer_pending(&output_buffer) == begin)
+      bytebuffer_unappend(&output_buffer, sizeof(SYNC_BEGIN) - 1);
+    else
+      bytebuffer_append(&output_buffer, SYNC_END, sizeof(SYNC_END) - 1);
+  }
+
+  frame_stats.diff_ns = ns_since(t);
+  get_time(&t);
+
+  // without frames to drop, a stalled tty would have the queue grow forever
+  if (bytebuffer_flush(&output_buffer, inout) > OUTPUT_PENDING_MAX)
+    bytebuffer_flush_all(&output_buffer, inout);
+  frame_stats.flush_ns = ns_since(t);
+
+  frame_stats.frames = 1;
+  frame_stats.bytes_written = output_buffer.written - written;
+  frame_stats.writes = output_buffer.writes - writes;
+
+  total_stats.frames++;
+  total_stats.cells_compared += frame_stats.cells_compared;
+  total_stats.cells_emitted += frame_stats.cells_emitted;
+  total_stats.cursor_jumps += frame_stats.cursor_jumps;
+  total_stats.sgr_switches += frame_stats.sgr_switches;
+  total_stats.diff_ns += frame_stats.diff_ns;
+  total_stats.flush_ns += frame_stats.flush_ns;
+}
+
+void tb_get_stats(struct tb_stats *frame, struct tb_stats *total) {
+  if (frame)
+    *frame = frame_stats;
+
+  if (total) {
+    *total = total_stats;
+    total->bytes_written = output_buffer.written;
+    total->writes = output_buffer.writes;
+  }
 }
 
 void tb_set_cursor(int cx, int cy) {
@@ -291,6 +615,10 @@ void tb_flush(void) {
   bytebuffer_flush(&output_buffer, inout);
 }
 
+int tb_output_pending(void) {
+  return bytebuffer_pending(&output_buffer);
+}
+
 void tb_send(const char * str) {
   bytebuffer_puts(&output_buffer, str); // same as append but without length
 }
@@ -303,14 +631,49 @@ void tb_sendf(const char * fmt, ...) {
   return tb_send(print_buf);
 }
 
-void tb_cell(int x, int y, const struct tb_cell *cell) {
-  if ((unsigned)x >= (unsigned)back_buffer.width)
+// picks up whatever was written through tb_cell_buffer()
+static void take_exposed_cells(void) {
+  int y;
+
+#ifdef WITH_SOA_CELLS
+  cellbuf_unpack(&back_buffer);
+#endif
+
+  for (y = 0; y < back_buffer.height; ++y)
+    cellbuf_measure_row(&back_buffer, y);
+
+  cells_exposed = 0;
+}
+
+static void put_cell(int x, int y, const struct tb_cell *cell, int w) {
+  if ((unsigned)x >= (unsigned)draw_buf->width)
     return;
 
-  if ((unsigned)y >= (unsigned)back_buffer.height)
+  if ((unsigned)y >= (unsigned)draw_buf->height)
     return;
 
-  CELL(&back_buffer, x, y) = *cell;
+  int i = CELL_AT(draw_buf, x, y);
+
+  CELL_CH(draw_buf, i) = cell->ch;
+  CELL_FG(draw_buf, i) = cell->fg;
+  CELL_BG(draw_buf, i) = cell->bg;
+
+#ifdef WITH_SOA_CELLS
+  // keep the copy handed out by tb_cell_buffer() in sync
+  if (draw_buf->view && cells_exposed)
+    draw_buf->view[i] = *cell;
+#endif
+
+  if (draw_buf->widths[i] != w) {
+    draw_buf->wide_count[y] += (w == 2) ? 1 : -1;
+    draw_buf->widths[i] = w;
+  }
+
+  cellbuf_touch(draw_buf, x, x, y);
+}
+
+void tb_cell(int x, int y, const struct tb_cell *cell) {
+  put_cell(x, y, cell, char_width(cell->ch));
 }
 
 void tb_char(int x, int y, tb_color fg, tb_color bg, tb_chr ch) {
@@ -319,15 +682,15 @@ void tb_char(int x, int y, tb_color fg, tb_color bg, tb_chr ch) {
 }
 
 int tb_string_with_limit(int x, int y, tb_color fg, tb_color bg, const char *str, int limit) {
-  tb_chr uni;
+  struct tb_cell cell = {0, fg, bg};
   int w, c = 0, l = 0;
 
   while (*str && l < limit) {
-    str += tb_utf8_char_to_unicode(&uni, str);
-    tb_char(x, y, fg, bg, uni);
-    w = tb_unicode_is_char_wide(uni) ? 2 : 1;
+    str += tb_utf8_char_to_unicode(&cell.ch, str);
+    w = char_width(cell.ch);
+    put_cell(x, y, &cell, w);
     c++;
-    x++;
+    x += w;
     l = l + w;
   }
 
@@ -346,24 +709,258 @@ int tb_stringf(int x, int y, tb_color fg, tb_color bg, const char *fmt, ...) {
   return tb_string(x, y, fg, bg, print_buf);
 }
 
+// clips a rectangle to the drawing target, returns 0 if nothing is left
+static int clip_rect(int *x, int *y, int *w, int *h) {
+  if (*x < 0) { *w += *x; *x = 0; }
+  if (*y < 0) { *h += *y; *y = 0; }
+  if (*x + *w > draw_buf->width) *w = draw_buf->width - *x;
+  if (*y + *h > draw_buf->height) *h = draw_buf->height - *y;
+  return *w > 0 && *h > 0;
+}
+
+void tb_fill_rect(int x, int y, int w, int h, tb_color fg, tb_color bg, tb_chr ch) {
+  struct tb_cell cell = {ch, fg, bg};
+  int i, row, cw = char_width(ch);
+
+  if (!clip_rect(&x, &y, &w, &h))
+    return;
+
+  // write the first row, then copy it down
+  for (i = x; i < x + w; ++i)
+    put_cell(i, y, &cell, cw);
+
+  for (row = y + 1; row < y + h; ++row)
+    cellbuf_copy_cells(draw_buf, x, row, draw_buf, x, y, w);
+}
+
+void tb_hline(int x, int y, int n, tb_color fg, tb_color bg, tb_chr ch) {
+  tb_fill_rect(x, y, n, 1, fg, bg, ch);
+}
+
+void tb_vline(int x, int y, int n, tb_color fg, tb_color bg, tb_chr ch) {
+  tb_fill_rect(x, y, 1, n, fg, bg, ch);
+}
+
+void tb_clear_region(int x, int y, int w, int h) {
+  int row;
+
+  if (buffer_size_change_request)
+    tb_resize();
+
+  if (!clip_rect(&x, &y, &w, &h))
+    return;
+
+  const struct cellbuf *blank = clear_row_for(draw_buf);
+
+  for (row = y; row < y + h; ++row)
+    cellbuf_copy_cells(draw_buf, x, row, blank, 0, 0, w);
+}
+
+struct tb_sprite *tb_sprite_new(int w, int h, const struct tb_cell *cells) {
+  struct tb_sprite *sprite;
+  int i, y;
+
+  if (w <= 0 || h <= 0 || w > INT_MAX / h)
+    return NULL;
+
+  sprite = (struct tb_sprite*)malloc(sizeof(struct tb_sprite));
+  if (!sprite)
+    return NULL;
+
+  if (!cellbuf_alloc(&sprite->buf, w, h)) {
+    free(sprite);
+    return NULL;
+  }
+
+  for (i = 0; i < w * h; ++i) {
+    CELL_CH(&sprite->buf, i) = cells ? cells[i].ch : ' ';
+    CELL_FG(&sprite->buf, i) = cells ? cells[i].fg : TB_DEFAULT;
+    CELL_BG(&sprite->buf, i) = cells ? cells[i].bg : TB_DEFAULT;
+  }
+
+  for (y = 0; y < h; ++y)
+    cellbuf_measure_row(&sprite->buf, y);
+
+  return sprite;
+}
+
+void tb_sprite_free(struct tb_sprite *sprite) {
+  if (!sprite)
+    return;
+
+  if (draw_buf == &sprite->buf)
+    draw_buf = cur_layer ? &layers[cur_layer - 1] : &back_buffer;
+
+  cellbuf_free(&sprite->buf);
+  free(sprite);
+}
+
+struct tb_sprite *tb_snapshot(struct tb_sprite *sprite) {
+  int y;
+
+  if (buffer_size_change_request)
+    tb_resize();
+
+  // an old snapshot of another size can't be reused
+  if (sprite && (sprite->buf.width != back_buffer.width ||
+                 sprite->buf.height != back_buffer.height)) {
+    tb_sprite_free(sprite);
+    sprite = NULL;
+  }
+
+  if (!sprite) {
+    sprite = tb_sprite_new(back_buffer.width, back_buffer.height, NULL);
+    if (!sprite)
+      return NULL;
+  }
+
+#ifdef WITH_SOA_CELLS
+  // the planes may lag behind what was written through tb_cell_buffer()
+  if (cells_exposed)
+    cellbuf_unpack(&back_buffer);
+#endif
+
+  for (y = 0; y < back_buffer.height; ++y) {
+    cellbuf_copy_cells(&sprite->buf, 0, y, &back_buffer, 0, y, back_buffer.width);
+    if (cells_exposed)
+      cellbuf_measure_row(&sprite->buf, y);
+  }
+
+  return sprite;
+}
+
+void tb_select_sprite(struct tb_sprite *sprite) {
+  draw_buf = sprite ? &sprite->buf
+           : cur_layer ? &layers[cur_layer - 1] : &back_buffer;
+}
+
+int tb_select_layer(int layer) {
+  struct cellbuf *buf;
+
+  if (layer < 0 || layer >= TB_MAX_LAYERS)
+    return -1;
+
+  if (buffer_size_change_request)
+    tb_resize();
+
+  // layers are created on first use, along with the composite
+  while (num_layers <= layer) {
+    buf = &layers[num_layers - 1];
+    cellbuf_init(buf, back_buffer.width, back_buffer.height);
+    buf->used = (struct span*)malloc(sizeof(struct span) * buf->height);
+    assert(buf->used);
+    memcpy(buf->used, buf->dirty, sizeof(struct span) * buf->height);
+    cellbuf_clear(buf);
+
+    if (num_layers == 1) {
+      cellbuf_init(&comp_buffer, back_buffer.width, back_buffer.height);
+      cellbuf_touch_all(&back_buffer);
+    }
+    num_layers++;
+  }
+
+  cur_layer = layer;
+  draw_buf = layer ? &layers[layer - 1] : &back_buffer;
+  return 0;
+}
+
+void tb_blit(int x, int y, const struct tb_sprite *sprite) {
+  int w = sprite->buf.width;
+  int h = sprite->buf.height;
+  int sx, sy, row;
+
+  if (buffer_size_change_request)
+    tb_resize();
+
+  // remember where the clipped rectangle starts inside the sprite
+  sx = x; sy = y;
+  if (!clip_rect(&x, &y, &w, &h))
+    return;
+  sx = x - sx; sy = y - sy;
+
+  for (row = 0; row < h; ++row)
+    cellbuf_copy_cells(draw_buf, x, y + row, &sprite->buf, sx, sy + row, w);
+}
+
 void tb_empty(int x, int y, tb_color bg, int width) {
   sprintf(print_buf, "%*s", width, "");
   tb_string_with_limit(x, y, TB_DEFAULT, bg, print_buf, width);
 }
 
 struct tb_cell *tb_cell_buffer(void) {
+  // the caller may write anywhere through it
+  cellbuf_touch_all(&back_buffer);
+#ifdef WITH_SOA_CELLS
+  if (!cells_exposed)
+    cellbuf_pack(&back_buffer);
+  cells_exposed = 1;
+  return back_buffer.view;
+#else
+  cells_exposed = 1;
   return back_buffer.cells;
+#endif
 }
 
 int tb_poll_event(struct tb_event *event) {
-  return wait_fill_event(event, 0);
+  return wait_fill_event(event, -1);
 }
 
 int tb_peek_event(struct tb_event *event, int timeout) {
-  struct timeval tv;
-  tv.tv_sec = timeout / 1000;
-  tv.tv_usec = (timeout - (tv.tv_sec * 1000)) * 1000;
-  return wait_fill_event(event, &tv);
+  return wait_fill_event(event, timeout);
+}
+
+int tb_peek_events(struct tb_event *events, int max, int timeout) {
+  int n = 0, res;
+
+  if (max < 1) return 0;
+
+  // the events that came with the error went out with the last call
+  if (peek_error) {
+    peek_error = false;
+    return -1;
+  }
+
+  res = wait_fill_event(&events[n], timeout);
+  if (res <= 0) return res;
+
+  for (n = 1; n < max; n++) {
+    // what was already read needs no syscall
+    if (extract_event(&events[n]))
+      continue;
+
+    res = wait_fill_event(&events[n], 0);
+    if (res <= 0) {
+      peek_error = res < 0;
+      break;
+    }
+  }
+
+  return n;
+}
+
+int tb_set_tick(int interval) {
+  if (interval < 0) interval = 0;
+
+#ifdef __linux__
+  struct itimerspec its;
+  memset(&its, 0, sizeof(its));
+  its.it_interval.tv_sec  = interval / 1000;
+  its.it_interval.tv_nsec = (interval % 1000) * 1000000L;
+  its.it_value = its.it_interval;
+
+  // a zero it_value disarms the timer and drops pending expirations
+  return timerfd_settime(tick_fd, 0, &its, NULL) == 0 ? 0 : -1;
+#else
+  tick_interval = interval;
+  gettimeofday(&tick_next, NULL);
+  tick_next.tv_sec  += interval / 1000;
+  tick_next.tv_usec += (interval % 1000) * 1000;
+  if (tick_next.tv_usec >= 1000000) {
+    tick_next.tv_sec++;
+    tick_next.tv_usec -= 1000000;
+  }
+  return 0;
+#endif
 }
 
 int tb_width(void) {
@@ -375,36 +972,43 @@ int tb_height(void) {
 }
 
 void tb_hide_cursor(void) {
-  bytebuffer_puts(&output_buffer, funcs[T_HIDE_CURSOR]);
+  put_func(T_HIDE_CURSOR);
 }
 
 void tb_show_cursor(void) {
-  bytebuffer_puts(&output_buffer, funcs[T_SHOW_CURSOR]);
+  put_func(T_SHOW_CURSOR);
 }
 
 void tb_enable_mouse(void) {
-  bytebuffer_puts(&output_buffer, funcs[T_ENTER_MOUSE]);
+  put_func(T_ENTER_MOUSE);
   bytebuffer_flush(&output_buffer, inout);
 }
 
 void tb_disable_mouse(void) {
-  bytebuffer_puts(&output_buffer, funcs[T_EXIT_MOUSE]);
+  put_func(T_EXIT_MOUSE);
   bytebuffer_flush(&output_buffer, inout);
 }
 
 int tb_select_output_mode(int mode) {
-  if (mode) output_mode = mode;
+  if (mode && mode != output_mode) {
+    output_mode = mode;
+    lastfg = lastbg = LAST_ATTR_INIT; // colors come out differently now
+    memset(sgr_cache, 0, sizeof(sgr_cache));
+  }
   return output_mode;
 }
 
 void tb_set_clear_attributes(tb_color fg, tb_color bg) {
+  if (fg != foreground || bg != background)
+    blank_row_stale = 1;
+
   foreground = fg;
   background = bg;
 }
 
 void tb_clear_screen(void) {
   set_colors(foreground, background);
-  bytebuffer_puts(&output_buffer, funcs[T_CLEAR_SCREEN]);
+  put_func(T_CLEAR_SCREEN);
 
   if (!IS_CURSOR_HIDDEN(cursor_x, cursor_y))
     write_cursor(cursor_x, cursor_y);
@@ -424,122 +1028,457 @@ void tb_clear_buffer(void) {
   if (buffer_size_change_request)
     tb_resize();
 
-  cellbuf_clear(&back_buffer);
+  if (cur_layer)
+    layer_clear(&layers[cur_layer - 1]);
+  else
+    cellbuf_clear(&back_buffer);
 }
 
 void tb_resize(void) {
+  int i;
+
   if (buffer_size_change_request) {
     buffer_size_change_request = 0;
   } else {
     update_term_size();
   }
 
+  // pointers from tb_cell_buffer() don't survive a resize
+  if (cells_exposed)
+    take_exposed_cells();
+
   cellbuf_resize(&back_buffer, termw, termh);
   cellbuf_resize(&front_buffer, termw, termh);
   cellbuf_clear(&front_buffer);
+  cellbuf_touch_all(&back_buffer);
+
+  for (i = 1; i < num_layers; ++i)
+    cellbuf_resize(&layers[i - 1], termw, termh);
+  if (num_layers > 1)
+    cellbuf_resize(&comp_buffer, termw, termh);
 
   tb_clear_screen();
 }
 
 /* -------------------------------------------------------- */
 
-static void cellbuf_init(struct cellbuf *buf, int width, int height) {
+// like cellbuf_init(), but returns false instead of asserting when out of
+// memory, with nothing left allocated
+static bool cellbuf_alloc(struct cellbuf *buf, int width, int height) {
+#ifdef WITH_SOA_CELLS
+  buf->chs = (tb_chr*)malloc(sizeof(tb_chr) * width * height);
+  buf->fgs = (tb_color*)malloc(sizeof(tb_color) * width * height);
+  buf->bgs = (tb_color*)malloc(sizeof(tb_color) * width * height);
+  buf->view = NULL;
+  bool ok = buf->chs && buf->fgs && buf->bgs;
+#else
   buf->cells = (struct tb_cell*)malloc(sizeof(struct tb_cell) * width * height);
-  assert(buf->cells);
+  bool ok = buf->cells != NULL;
+#endif
+  buf->widths = (uint8_t*)malloc(width * height);
+  buf->wide_count = (int*)calloc(height, sizeof(int));
+  buf->dirty = (struct span*)malloc(sizeof(struct span) * height);
+  buf->used = NULL;
+
+  if (!ok || !buf->widths || !buf->wide_count || !buf->dirty) {
+    cellbuf_free(buf);
+    return false;
+  }
+
   buf->width = width;
   buf->height = height;
+  cellbuf_touch_all(buf);
+  return true;
+}
+
+static void cellbuf_init(struct cellbuf *buf, int width, int height) {
+  bool ok = cellbuf_alloc(buf, width, height);
+  assert(ok);
+  (void)ok;
 }
 
 static void cellbuf_resize(struct cellbuf *buf, int width, int height) {
   if (buf->width == width && buf->height == height)
     return;
 
-  int oldw = buf->width;
-  int oldh = buf->height;
-  struct tb_cell *oldcells = buf->cells;
+  struct cellbuf old = *buf;
 
   cellbuf_init(buf, width, height);
+  if (old.used) {
+    buf->used = (struct span*)malloc(sizeof(struct span) * height);
+    assert(buf->used);
+    memcpy(buf->used, buf->dirty, sizeof(struct span) * height);
+  }
   cellbuf_clear(buf);
 
-  int minw = (width < oldw) ? width : oldw;
-  int minh = (height < oldh) ? height : oldh;
+  int minw = (width < old.width) ? width : old.width;
+  int minh = (height < old.height) ? height : old.height;
   int i;
 
   for (i = 0; i < minh; ++i) {
-    struct tb_cell *csrc = oldcells + (i * oldw);
-    struct tb_cell *cdst = buf->cells + (i * width);
-    memcpy(cdst, csrc, sizeof(struct tb_cell) * minw);
+    int src = i * old.width;
+    int dst = i * width;
+#ifdef WITH_SOA_CELLS
+    memcpy(buf->chs + dst, old.chs + src, sizeof(tb_chr) * minw);
+    memcpy(buf->fgs + dst, old.fgs + src, sizeof(tb_color) * minw);
+    memcpy(buf->bgs + dst, old.bgs + src, sizeof(tb_color) * minw);
+#else
+    memcpy(buf->cells + dst, old.cells + src, sizeof(struct tb_cell) * minw);
+#endif
+    memcpy(buf->widths + dst, old.widths + src, minw);
+    cellbuf_measure_row(buf, i);
+    if (buf->used)
+      buf->used[i] = buf->dirty[i];
   }
 
-  free(oldcells);
+  cellbuf_free(&old);
 }
 
 static void cellbuf_clear(struct cellbuf *buf) {
-  int i;
-  int ncells = buf->width * buf->height;
+  const struct cellbuf *blank = clear_row_for(buf);
+  int y;
 
-  for (i = 0; i < ncells; ++i) {
-    buf->cells[i].ch = ' ';
-    buf->cells[i].fg = foreground;
-    buf->cells[i].bg = background;
+  for (y = 0; y < buf->height; ++y)
+    cellbuf_copy_cells(buf, 0, y, blank, 0, 0, buf->width);
+
+  cellbuf_touch_all(buf);
+  if (buf->used)
+    for (y = 0; y < buf->height; ++y)
+      cellbuf_clean_row(buf, y);
+}
+
+// clears only the cells a layer had drawn on since its last clear
+static void layer_clear(struct cellbuf *buf) {
+  const struct cellbuf *blank = clear_row_for(buf);
+  struct span *used;
+  int y;
+
+  for (y = 0; y < buf->height; ++y) {
+    used = &buf->used[y];
+    if (used->min > used->max)
+      continue;
+    cellbuf_copy_cells(buf, used->min, y, blank, 0, 0, used->max - used->min + 1);
+    used->min = buf->width;
+    used->max = -1;
   }
 }
 
 static void cellbuf_free(struct cellbuf *buf) {
+#ifdef WITH_SOA_CELLS
+  free(buf->chs);
+  free(buf->fgs);
+  free(buf->bgs);
+  free(buf->view);
+#else
   free(buf->cells);
+#endif
+  free(buf->widths);
+  free(buf->wide_count);
+  free(buf->dirty);
+  free(buf->used);
 }
 
-static void update_term_size(void) {
-  struct winsize sz;
-  memset(&sz, 0, sizeof(sz));
-  ioctl(inout, TIOCGWINSZ, &sz);
+static void cellbuf_touch_all(struct cellbuf *buf) {
+  int y;
 
-  termw = sz.ws_col;
-  termh = sz.ws_row;
+  for (y = 0; y < buf->height; ++y) {
+    buf->dirty[y].min = 0;
+    buf->dirty[y].max = buf->width - 1;
+  }
 }
 
-static uint8_t base_colors[8][3] = {
- { 1, 1, 1 }, // black
- { 1, 0, 0 }, // red
- { 0, 1, 0 }, // green
- { 1, 1, 0 }, // yellow
- { 0, 0, 1 }, // blue
- { 1, 0, 1 }, // magenta
- { 0, 1, 1 }, // cyan
- { 1, 1, 1 }  // white
-};
+static void cellbuf_measure_row(struct cellbuf *buf, int y) {
+  int row = CELL_AT(buf, 0, y);
+  int x, wide = 0;
 
-// int levels = { 0x00, 0x5f, 0x87, 0xaf, 0xd7, 0xff };
-static int steps[6] = { 47, 115, 155, 195, 235, 256 }; // in between of each level
+  for (x = 0; x < buf->width; ++x) {
+    buf->widths[row + x] = char_width(CELL_CH(buf, row + x));
+    wide += buf->widths[row + x] == 2;
+  }
 
-uint8_t get_256_color(uint32_t color) {
-  // extract rgb values from number (e.g. 0xffcc00 -> 16763904)
-  uint8_t rgb[3] = { 0, 0, 0 }; // r, g, b
-  rgb[0] = (color >> 16) & 0xFF; // e.g. 255
-  rgb[1] = (color >> 8)  & 0xFF; // e.g. 204
-  rgb[2] = (color >> 0)  & 0xFF; // e.g. 0
+  buf->wide_count[y] = wide;
+}
 
-  // now, translate rgb to their most similar value between the 0-5 range
-  int nums[3] = { 0, 0, 0 };
-  for (int c = 0; c < 3; c++) {
-    for (int i = 0; i < 6; i++) {
-      if (steps[i] > rgb[c]) {
-        nums[c] = i;
-        break;
-      }
-    }
+// returns the offset of the first byte where a and b differ, or n
+static size_t first_diff(const void *a, const void *b, size_t n) {
+  const unsigned char *pa = a, *pb = b;
+  size_t i = 0;
+
+#if defined(__AVX2__)
+  for (; i + 32 <= n; i += 32) {
+    __m256i va = _mm256_loadu_si256((const __m256i*)(pa + i));
+    __m256i vb = _mm256_loadu_si256((const __m256i*)(pb + i));
+    unsigned mask = ~(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb));
+    if (mask)
+      return i + __builtin_ctz(mask);
+  }
+#elif defined(__SSE2__)
+  for (; i + 16 <= n; i += 16) {
+    __m128i va = _mm_loadu_si128((const __m128i*)(pa + i));
+    __m128i vb = _mm_loadu_si128((const __m128i*)(pb + i));
+    unsigned mask = ~(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) & 0xffff;
+    if (mask)
+      return i + __builtin_ctz(mask);
   }
+#endif
 
-  // 16 + (r * 36) + (g * 6) + b
-  return 16 + (nums[0] * 36) + (nums[1] * 6) + nums[2];
+  for (; i < n && pa[i] == pb[i]; ++i);
+  return i;
 }
 
-uint8_t get_base_color(uint32_t color) {
+// first column in [x, end) of a row where the two buffers differ, or end
+static int cellbuf_row_diff(struct cellbuf *a, struct cellbuf *b, int row, int x, int end) {
+#ifdef WITH_SOA_CELLS
+  // each plane only needs scanning up to the closest difference so far
+  end = x + first_diff(a->chs + row + x, b->chs + row + x,
+                       sizeof(tb_chr) * (end - x)) / sizeof(tb_chr);
+  end = x + first_diff(a->fgs + row + x, b->fgs + row + x,
+                       sizeof(tb_color) * (end - x)) / sizeof(tb_color);
+  end = x + first_diff(a->bgs + row + x, b->bgs + row + x,
+                       sizeof(tb_color) * (end - x)) / sizeof(tb_color);
+  return end;
+#else
+  return x + first_diff(a->cells + row + x, b->cells + row + x,
+                        sizeof(struct tb_cell) * (end - x)) / sizeof(struct tb_cell);
+#endif
+}
 
-  // extract rgb values and round them to either 0 or 1
-  uint8_t rgb[3] = { 0, 0, 0 }; // r, g, b
-  rgb[0] = ((color >> 16) & 0xFF) > 128 ? 1 : 0;
-  rgb[1] = ((color >> 8)  & 0xFF) > 128 ? 1 : 0;
+#ifdef WITH_SOA_CELLS
+// gathers the planes into the packed view
+static void cellbuf_pack(struct cellbuf *buf) {
+  int i, ncells = buf->width * buf->height;
+
+  if (!buf->view) {
+    buf->view = (struct tb_cell*)malloc(sizeof(struct tb_cell) * ncells);
+    assert(buf->view);
+  }
+
+  for (i = 0; i < ncells; ++i) {
+    buf->view[i].ch = buf->chs[i];
+    buf->view[i].fg = buf->fgs[i];
+    buf->view[i].bg = buf->bgs[i];
+  }
+}
+
+// and scatters it back
+static void cellbuf_unpack(struct cellbuf *buf) {
+  int i, ncells = buf->width * buf->height;
+
+  for (i = 0; i < ncells; ++i) {
+    buf->chs[i] = buf->view[i].ch;
+    buf->fgs[i] = buf->view[i].fg;
+    buf->bgs[i] = buf->view[i].bg;
+  }
+}
+#endif
+
+static void cellbuf_clean_row(struct cellbuf *buf, int y) {
+  buf->dirty[y].min = buf->width;
+  buf->dirty[y].max = -1;
+}
+
+static void cellbuf_touch(struct cellbuf *buf, int x0, int x1, int y) {
+  struct span *dirty = &buf->dirty[y];
+  if (x0 < dirty->min) dirty->min = x0;
+  if (x1 > dirty->max) dirty->max = x1;
+
+  if (buf->used) {
+    struct span *used = &buf->used[y];
+    if (x0 < used->min) used->min = x0;
+    if (x1 > used->max) used->max = x1;
+  }
+}
+
+// count of wide chars among n cells starting at i
+static int count_wide(const struct cellbuf *buf, int i, int n) {
+  const uint8_t *w = buf->widths + i;
+  int k, wide = 0;
+
+  for (k = 0; k < n; ++k)
+    wide += w[k] == 2;
+
+  return wide;
+}
+
+// copies n cells (already clipped to both buffers) and their widths
+static void cellbuf_copy_cells(struct cellbuf *dst, int dx, int dy,
+                               const struct cellbuf *src, int sx, int sy, int n) {
+  int di = CELL_AT(dst, dx, dy);
+  int si = CELL_AT(src, sx, sy);
+
+  if (dst->wide_count[dy] > 0)
+    dst->wide_count[dy] -= count_wide(dst, di, n);
+  if (src->wide_count[sy] > 0)
+    dst->wide_count[dy] += count_wide(src, si, n);
+
+#ifdef WITH_SOA_CELLS
+  memcpy(dst->chs + di, src->chs + si, sizeof(tb_chr) * n);
+  memcpy(dst->fgs + di, src->fgs + si, sizeof(tb_color) * n);
+  memcpy(dst->bgs + di, src->bgs + si, sizeof(tb_color) * n);
+
+  // keep the copy handed out by tb_cell_buffer() in sync
+  if (dst->view && cells_exposed) {
+    int k;
+    for (k = di; k < di + n; ++k) {
+      dst->view[k].ch = dst->chs[k];
+      dst->view[k].fg = dst->fgs[k];
+      dst->view[k].bg = dst->bgs[k];
+    }
+  }
+#else
+  memcpy(dst->cells + di, src->cells + si, sizeof(struct tb_cell) * n);
+#endif
+  memcpy(dst->widths + di, src->widths + si, n);
+
+  cellbuf_touch(dst, dx, dx + n - 1, dy);
+}
+
+static void update_blank_row(int width) {
+  int i;
+
+  if (!blank_row_stale && blank_row.width >= width)
+    return;
+
+  // at least one cell, a terminal may well report zero columns
+  if (blank_row.width < width || blank_row.width == 0) {
+    if (blank_row.width > 0)
+      cellbuf_free(&blank_row);
+    cellbuf_init(&blank_row, width > 0 ? width : 1, 1);
+  }
+
+  for (i = 0; i < blank_row.width; ++i) {
+    CELL_CH(&blank_row, i) = ' ';
+    CELL_FG(&blank_row, i) = foreground;
+    CELL_BG(&blank_row, i) = background;
+  }
+
+  memset(blank_row.widths, 1, blank_row.width);
+  blank_row.wide_count[0] = 0;
+  blank_row_stale = 0;
+}
+
+// union of a row's dirty spans over all layers, returns 0 if it's empty
+static int dirty_span(int y, int *x0, int *x1) {
+  int l;
+
+  *x0 = back_buffer.dirty[y].min;
+  *x1 = back_buffer.dirty[y].max;
+
+  for (l = 1; l < num_layers; ++l) {
+    if (layers[l - 1].dirty[y].min < *x0) *x0 = layers[l - 1].dirty[y].min;
+    if (layers[l - 1].dirty[y].max > *x1) *x1 = layers[l - 1].dirty[y].max;
+  }
+
+  return *x0 <= *x1;
+}
+
+// rebuilds columns [x0, x1] of a composite row, topmost non-zero ch wins
+static void composite_row(int y, int x0, int x1) {
+  struct cellbuf *layer;
+  int l, i, row = CELL_AT(&comp_buffer, 0, y);
+  int wide = back_buffer.wide_count[y];
+
+  cellbuf_copy_cells(&comp_buffer, x0, y, &back_buffer, x0, y, x1 - x0 + 1);
+
+  for (l = 1; l < num_layers; ++l) {
+    layer = &layers[l - 1];
+    wide += layer->wide_count[y];
+
+    for (i = row + x0; i <= row + x1; ++i) {
+      if (CELL_CH(layer, i) == 0)
+        continue;
+      CELL_CH(&comp_buffer, i) = CELL_CH(layer, i);
+      CELL_FG(&comp_buffer, i) = CELL_FG(layer, i);
+      CELL_BG(&comp_buffer, i) = CELL_BG(layer, i);
+      comp_buffer.widths[i] = layer->widths[i];
+    }
+  }
+
+  // only worth counting when some layer has wide chars on this row
+  comp_buffer.wide_count[y] = wide ? count_wide(&comp_buffer, row, comp_buffer.width) : 0;
+}
+
+// the row a buffer is cleared with: blanks, or transparent cells for a layer
+static const struct cellbuf *clear_row_for(const struct cellbuf *buf) {
+  int i;
+
+  if (!buf->used) {
+    update_blank_row(buf->width);
+    return &blank_row;
+  }
+
+  if (empty_row.width < buf->width) {
+    if (empty_row.width > 0)
+      cellbuf_free(&empty_row);
+    cellbuf_init(&empty_row, buf->width, 1);
+
+    for (i = 0; i < empty_row.width; ++i) {
+      CELL_CH(&empty_row, i) = 0;
+      CELL_FG(&empty_row, i) = TB_DEFAULT;
+      CELL_BG(&empty_row, i) = TB_DEFAULT;
+    }
+    memset(empty_row.widths, 1, empty_row.width);
+    empty_row.wide_count[0] = 0;
+  }
+
+  return &empty_row;
+}
+
+static void update_term_size(void) {
+  struct winsize sz;
+
+  if (headless) // the size given is the size
+    return;
+
+  memset(&sz, 0, sizeof(sz));
+  ioctl(inout, TIOCGWINSZ, &sz);
+
+  termw = sz.ws_col;
+  termh = sz.ws_row;
+}
+
+static uint8_t base_colors[8][3] = {
+ { 1, 1, 1 }, // black
+ { 1, 0, 0 }, // red
+ { 0, 1, 0 }, // green
+ { 1, 1, 0 }, // yellow
+ { 0, 0, 1 }, // blue
+ { 1, 0, 1 }, // magenta
+ { 0, 1, 1 }, // cyan
+ { 1, 1, 1 }  // white
+};
+
+// int levels = { 0x00, 0x5f, 0x87, 0xaf, 0xd7, 0xff };
+static int steps[6] = { 47, 115, 155, 195, 235, 256 }; // in between of each level
+
+uint8_t get_256_color(uint32_t color) {
+  // extract rgb values from number (e.g. 0xffcc00 -> 16763904)
+  uint8_t rgb[3] = { 0, 0, 0 }; // r, g, b
+  rgb[0] = (color >> 16) & 0xFF; // e.g. 255
+  rgb[1] = (color >> 8)  & 0xFF; // e.g. 204
+  rgb[2] = (color >> 0)  & 0xFF; // e.g. 0
+
+  // now, translate rgb to their most similar value between the 0-5 range
+  int nums[3] = { 0, 0, 0 };
+  for (int c = 0; c < 3; c++) {
+    for (int i = 0; i < 6; i++) {
+      if (steps[i] > rgb[c]) {
+        nums[c] = i;
+        break;
+      }
+    }
+  }
+
+  // 16 + (r * 36) + (g * 6) + b
+  return 16 + (nums[0] * 36) + (nums[1] * 6) + nums[2];
+}
+
+uint8_t get_base_color(uint32_t color) {
+
+  // extract rgb values and round them to either 0 or 1
+  uint8_t rgb[3] = { 0, 0, 0 }; // r, g, b
+  rgb[0] = ((color >> 16) & 0xFF) > 128 ? 1 : 0;
+  rgb[1] = ((color >> 8)  & 0xFF) > 128 ? 1 : 0;
   rgb[2] = ((color >> 0)  & 0xFF) > 128 ? 1 : 0;
 
   uint8_t i;
@@ -565,20 +1504,40 @@ tb_color tb_rgb(uint32_t in) {
   }
 }
 
-static int convertnum(uint8_t num, char* buf) {
-  int i, l = 0;
-  int ch;
-  do {
-    buf[l++] = '0' + (num % 10);
-    num /= 10;
-  } while (num);
+static int num_length(uint32_t n) {
+  int l = 1;
+  while (n >= 100) { n /= 100; l += 2; }
+  return n >= 10 ? l + 1 : l;
+}
 
-  for(i = 0; i < l / 2; i++) {
-    ch = buf[i];
-    buf[i] = buf[l - 1 - i];
-    buf[l - 1 - i] = ch;
+static const char digit_pairs[] =
+  "00010203040506070809"
+  "10111213141516171819"
+  "20212223242526272829"
+  "30313233343536373839"
+  "40414243444546474849"
+  "50515253545556575859"
+  "60616263646566676869"
+  "70717273747576777879"
+  "80818283848586878889"
+  "90919293949596979899";
+
+// writes num in decimal to buf, two digits at a time from the end
+static int convertnum(uint32_t num, char* buf) {
+  int l = num_length(num);
+  char *p = buf + l;
+
+  while (num >= 100) {
+    p -= 2;
+    memcpy(p, digit_pairs + num % 100 * 2, 2);
+    num /= 100;
   }
 
+  if (num >= 10)
+    memcpy(p - 2, digit_pairs + num * 2, 2);
+  else
+    p[-1] = '0' + num;
+
   return l;
 }
 
@@ -606,86 +1565,70 @@ uint8_t map_to_base_color(tb_color col) {
 #define WRITE_LITERAL(X) bytebuffer_append(&output_buffer, (X), sizeof(X)-1)
 #define WRITE_INT(X) bytebuffer_append(&output_buffer, buf, convertnum((X), buf))
 
-static tb_color lastfg = LAST_ATTR_INIT, lastbg = LAST_ATTR_INIT;
-
-static void set_colors(tb_color fg, tb_color bg) {
-  if (fg == lastfg && bg == lastbg)
-    return;
+#define SGR_BOLD      1
+#define SGR_UNDERLINE 2
+#define SGR_REVERSE   4
 
-  lastfg = fg;
-  lastbg = bg;
+// converts a color for the output mode, telling if it's the default one
+static tb_color sgr_color(tb_color col, bool *is_default) {
+#ifdef WITH_TRUECOLOR
+  *is_default = col == TB_DEFAULT;
+  return output_mode == 2 ? col : tb_rgb(col);
+#else
+  // remove attributes
+  col &= 0xFF;
+  *is_default = col == TB_DEFAULT;
 
-  bytebuffer_puts(&output_buffer, funcs[T_SGR0]); // reset attrs
+  if (output_mode == 0) { // 16 colors
+    col = col > 16 ? map_to_base_color(col) : col; // & 0x0F;
 
-  if (fg & TB_BOLD) {
-    bytebuffer_puts(&output_buffer, funcs[T_BOLD]);
+    // TB_BLACK (0x10) has no sgr of its own. sent as 38/108 it's ignored,
+    // which with only the changed parameters sent leaves the old color on
+    if (col == TB_BLACK) col = 0;
   }
 
-  //if (bg & TB_BOLD)
-  //  bytebuffer_puts(&output_buffer, funcs[T_BLINK]);
+  return col;
+#endif
+}
 
-  if (fg & TB_UNDERLINE) {
-    bytebuffer_puts(&output_buffer, funcs[T_UNDERLINE]);
-  }
+// attributes a pair of colors turns on, SGR_* flags
+static int sgr_attrs(tb_color fg, tb_color bg) {
+  int attrs = 0;
+  bool is_default;
 
-  if ((fg & TB_REVERSE) || (bg & TB_REVERSE)) {
-    bytebuffer_puts(&output_buffer, funcs[T_REVERSE]);
-  }
+  if (fg & TB_BOLD) attrs |= SGR_BOLD;
+  if (fg & TB_UNDERLINE) attrs |= SGR_UNDERLINE;
+  if ((fg & TB_REVERSE) || (bg & TB_REVERSE)) attrs |= SGR_REVERSE;
 
-  tb_color fgcol, bgcol;
-  bool default_fg, default_bg;
+  // with 16 colors the upper 8 are reached through bold
+  if (output_mode == 0 && sgr_color(fg, &is_default) > 7 && !is_default)
+    attrs |= SGR_BOLD;
 
-#ifndef WITH_TRUECOLOR
-  // remove attributes
-  fgcol = fg & 0xFF;
-  bgcol = bg & 0xFF;
+  return attrs;
+}
 
-  default_fg = fgcol == TB_DEFAULT;
-  default_bg = bgcol == TB_DEFAULT;
+// writes the SGR parameter selecting one color
+static void write_color(tb_color col, bool is_default, bool is_bg) {
+  char buf[32];
 
-  if (default_fg && default_bg)
+  if (is_default) {
+    if (is_bg) WRITE_LITERAL("49");
+    else       WRITE_LITERAL("39");
     return;
-#endif
-
-  char buf[32];
-  WRITE_LITERAL("\033[");
+  }
 
 #ifdef WITH_TRUECOLOR
-
-  default_fg = fg == TB_DEFAULT;
-  default_bg = bg == TB_DEFAULT;
-
-  if (output_mode != 2) {
-
-    // convert rgb value to either 256 or 16 color
-    fgcol = tb_rgb(fg);
-    bgcol = tb_rgb(bg);
-
-  } else {
-
+  if (output_mode == 2) {
     // write RGB color to buffer
-    WRITE_LITERAL("38;2;");
-    WRITE_INT(fg >> 16 & 0xFF); // fg R
+    if (is_bg) WRITE_LITERAL("48;2;");
+    else       WRITE_LITERAL("38;2;");
+    WRITE_INT(col >> 16 & 0xFF); // R
     WRITE_LITERAL(";");
-    WRITE_INT(fg >> 8 & 0xFF);  // fg G
+    WRITE_INT(col >> 8 & 0xFF);  // G
     WRITE_LITERAL(";");
-    WRITE_INT(fg & 0xFF);       // fg B
-    WRITE_LITERAL(";48;2;");
-    WRITE_INT(bg >> 16 & 0xFF); // bg R
-    WRITE_LITERAL(";");
-    WRITE_INT(bg >> 8 & 0xFF);  // bg G
-    WRITE_LITERAL(";");
-    WRITE_INT(bg & 0xFF);       // bg B
-
-  }
-
-#else // no truecolor support
-
-  if (output_mode == 0) { // 16 colors
-    fgcol = fgcol > 16 ? map_to_base_color(fgcol) : fgcol; // & 0x0F;
-    bgcol = bgcol > 16 ? map_to_base_color(bgcol) : bgcol; // & 0x0F;
+    WRITE_INT(col & 0xFF);       // B
+    return;
   }
-
 #endif
 
   // 256 colors
@@ -708,15 +1651,9 @@ static void set_colors(tb_color fg, tb_color bg) {
 
   if (output_mode == 1) {
 
-    if (!default_fg) {
-      WRITE_LITERAL("38;5;");
-      WRITE_INT(fgcol);
-      if (!default_bg) WRITE_LITERAL(";");
-    }
-    if (!default_bg) {
-      WRITE_LITERAL("48;5;");
-      WRITE_INT(bgcol);
-    }
+    if (is_bg) WRITE_LITERAL("48;5;");
+    else       WRITE_LITERAL("38;5;");
+    WRITE_INT(col);
 
   // 16 color ISO
   // num   fg         bg
@@ -729,29 +1666,117 @@ static void set_colors(tb_color fg, tb_color bg) {
 
   } else if (output_mode == 0) {
 
-    if (!default_fg) {
-      if (fgcol > 7) { // upper 8
-        WRITE_LITERAL("1;3");
-        WRITE_INT(fgcol - 8);
-      } else {
-        WRITE_LITERAL("3");
-        WRITE_INT(fgcol);
-      }
-      if (!default_bg) WRITE_LITERAL(";");
-    }
-
-    if (!default_bg) {
-      if (bgcol > 7) { // upper 8
+    if (is_bg) {
+      if (col > 7) { // upper 8
         WRITE_LITERAL("10"); // "1;4"
-        WRITE_INT(bgcol - 8);
+        col -= 8;
       } else {
         WRITE_LITERAL("4");
-        WRITE_INT(bgcol);
       }
+    } else {
+      // the bold for the upper 8 comes from sgr_attrs()
+      WRITE_LITERAL("3");
+      if (col > 7) col -= 8;
     }
+    WRITE_INT(col);
+  }
+}
+
+static struct sgr_cache_entry *sgr_cache_slot(tb_color fg, tb_color bg) {
+  uint32_t h = (uint32_t)lastfg * 31 + lastbg;
+  h = (h * 31 + fg) * 31 + bg;
+  h ^= h >> 16;
+  h *= 0x45d9f3b;
+  h ^= h >> 16;
+  return &sgr_cache[h & (SGR_CACHE_SIZE - 1)];
+}
+
+// sends only what changed since the last call, resetting everything first
+// only when an attribute has to be turned off
+static void set_colors(tb_color fg, tb_color bg) {
+  tb_color fgcol, bgcol, oldfgcol = 0, oldbgcol = 0;
+  bool default_fg, default_bg, olddefault_fg = true, olddefault_bg = true;
+  int attrs, params = 0, start, pending;
+  struct sgr_cache_entry *e;
+
+  if (fg == lastfg && bg == lastbg)
+    return;
+
+  frame_stats.sgr_switches++;
+
+  e = sgr_cache_slot(fg, bg);
+  if (e->used && e->fromfg == lastfg && e->frombg == lastbg && e->fg == fg && e->bg == bg) {
+    bytebuffer_append(&output_buffer, e->seq, e->len);
+    lastfg = fg;
+    lastbg = bg;
+    lastattrs = e->attrs;
+    return;
+  }
+
+  e->used = 0;
+  e->fromfg = lastfg;
+  e->frombg = lastbg;
+  start = output_buffer.len;
+  pending = bytebuffer_pending(&output_buffer);
+
+  attrs = sgr_attrs(fg, bg);
+  fgcol = sgr_color(fg, &default_fg);
+  bgcol = sgr_color(bg, &default_bg);
+
+  if (lastfg == LAST_ATTR_INIT || (lastattrs & ~attrs)) {
+    put_func(T_SGR0); // reset attrs
+    lastattrs = 0;
+  } else {
+    oldfgcol = sgr_color(lastfg, &olddefault_fg);
+    oldbgcol = sgr_color(lastbg, &olddefault_bg);
   }
 
-  WRITE_LITERAL("m");
+  lastfg = fg;
+  lastbg = bg;
+
+  if (attrs & ~lastattrs & SGR_BOLD) {
+    put_func(T_BOLD);
+  }
+
+  //if (bg & TB_BOLD)
+  //  put_func(T_BLINK);
+
+  if (attrs & ~lastattrs & SGR_UNDERLINE) {
+    put_func(T_UNDERLINE);
+  }
+
+  if (attrs & ~lastattrs & SGR_REVERSE) {
+    put_func(T_REVERSE);
+  }
+
+  lastattrs = attrs;
+
+  if (default_fg != olddefault_fg || (!default_fg && fgcol != oldfgcol)) {
+    WRITE_LITERAL("\033[");
+    write_color(fgcol, default_fg, false);
+    params++;
+  }
+
+  if (default_bg != olddefault_bg || (!default_bg && bgcol != oldbgcol)) {
+    if (params) WRITE_LITERAL(";");
+    else        WRITE_LITERAL("\033[");
+    write_color(bgcol, default_bg, true);
+    params++;
+  }
+
+  if (params)
+    WRITE_LITERAL("m");
+
+  // keep it if it was all copied in, and fits
+  if (output_buffer.len - start == bytebuffer_pending(&output_buffer) - pending
+      && output_buffer.len - start <= SGR_CACHE_SEQ) {
+    e->fg = fg;
+    e->bg = bg;
+    e->attrs = attrs;
+    e->len = output_buffer.len - start;
+    memcpy(e->seq, output_buffer.buf + start, e->len);
+    e->used = 1;
+  }
 }
 
 static void write_cursor(int x, int y) {
@@ -767,18 +1792,193 @@ static void write_title(const char * title) {
   tb_sendf("%c]0;%s%c\n", '\033', title, '\007');
 }
 
-static void send_char(int x, int y, uint32_t c) {
-  char buf[7];
-  int bw = tb_utf8_unicode_to_char(buf, c);
+// bytes taken by "\033[<n><final>", where n = 1 is left out
+static int csi_length(int n) {
+  return n == 1 ? 3 : 3 + num_length(n);
+}
+
+static void write_csi(int n, char final) {
+  char buf[32];
+  WRITE_LITERAL("\033[");
+  if (n != 1) WRITE_INT(n);
+  bytebuffer_append(&output_buffer, &final, 1);
+}
+
+// whether cells [x0, x1) of a row on screen can just be printed again in
+// the current attributes to move over them, one byte each
+static int can_reprint(int x0, int x1, int y) {
+  int i, row = CELL_AT(&front_buffer, 0, y);
+
+  for (i = row + x0; i < row + x1; ++i) {
+    if (CELL_CH(&front_buffer, i) < ' ' || CELL_CH(&front_buffer, i) > '~')
+      return 0;
+    if (CELL_FG(&front_buffer, i) != lastfg || CELL_BG(&front_buffer, i) != lastbg)
+      return 0;
+  }
+  return 1;
+}
+
+// bytes needed to go right from x0 to x1 on row y, setting *reprint when
+// printing the cells in between is the cheapest way
+static int forward_length(int x0, int x1, int y, int *reprint) {
+  int n = x1 - x0;
+
+  *reprint = 0;
+  if (n == 0)
+    return 0;
+
+  if (n < csi_length(n) && can_reprint(x0, x1, y)) {
+    *reprint = 1;
+    return n;
+  }
+  return csi_length(n);
+}
+
+static void write_forward(int x0, int x1, int y, int reprint) {
+  int i, row = CELL_AT(&front_buffer, 0, y);
+  char ch;
+
+  if (x1 == x0)
+    return;
+
+  if (!reprint) {
+    write_csi(x1 - x0, 'C');
+    return;
+  }
+
+  for (i = row + x0; i < row + x1; ++i) {
+    ch = CELL_CH(&front_buffer, i);
+    bytebuffer_append(&output_buffer, &ch, 1);
+  }
+}
 
-  if (x-1 != lastx || y != lasty) {
+// moves the cursor to x, y picking the shortest of an absolute move and the
+// relative ones: up/down by LF or CUU/CUD, then CR, CUF/CUB or reprinting
+// the cells in between. raw mode has OPOST off, so LF keeps the column
+static void move_cursor(int x, int y) {
+  int best, cost, vert = 0, horiz, reprint, cr_reprint, use_cr = 0, dy;
+
+  frame_stats.cursor_jumps++;
+
+  if (lastx == LAST_COORD_INIT || lasty == LAST_COORD_INIT) {
     write_cursor(x, y);
+    return;
   }
 
-  lastx = x; lasty = y;
+  best = 4 + num_length(y + 1) + num_length(x + 1);
+
+  dy = y - lasty;
+  if (dy > 0)
+    vert = dy < csi_length(dy) ? dy : csi_length(dy);
+  else if (dy < 0)
+    vert = csi_length(-dy);
+
+  if (x >= lastx) {
+    horiz = forward_length(lastx, x, y, &reprint);
+  } else {
+    horiz = csi_length(lastx - x);
+    reprint = 0;
+  }
+
+  // going back to the first column can be cheaper
+  cost = 1 + forward_length(0, x, y, &cr_reprint);
+  if (cost < horiz) {
+    horiz = cost;
+    reprint = cr_reprint;
+    use_cr = 1;
+  }
+
+  if (best <= vert + horiz) {
+    write_cursor(x, y);
+    return;
+  }
+
+  if (dy > 0 && dy < csi_length(dy)) {
+    for (; dy > 0; --dy)
+      WRITE_LITERAL("\n");
+  } else if (dy > 0) {
+    write_csi(dy, 'B');
+  } else if (dy < 0) {
+    write_csi(-dy, 'A');
+  }
+
+  if (use_cr) {
+    WRITE_LITERAL("\r");
+    write_forward(0, x, y, reprint);
+  } else if (x >= lastx) {
+    write_forward(lastx, x, y, reprint);
+  } else {
+    write_csi(lastx - x, 'D');
+  }
+}
+
+static void send_char(int x, int y, uint32_t c, int w) {
+  char buf[7];
+  int bw = tb_utf8_unicode_to_char(buf, c);
+
+  if (x != lastx || y != lasty)
+    move_cursor(x, y);
+
   if (!c) buf[0] = ' '; // replace 0 with whitespace
 
   bytebuffer_append(&output_buffer, buf, bw);
+
+  // past the last column the cursor waits to wrap, don't rely on it
+  lastx = x + w; lasty = y;
+  if (lastx >= front_buffer.width)
+    lastx = LAST_COORD_INIT;
+}
+
+// cells from x on (before end) equal to the one at x, up to the last of
+// them that isn't on screen yet. 1 when there's nothing to shorten them with
+static int run_length(struct cellbuf *buf, int row, int x, int end) {
+  int i = row + x, k, n = 1;
+
+  if (!term_caps)
+    return 1;
+
+  for (k = i + 1; k < row + end; ++k) {
+    if (CELL_CH(buf, k) != CELL_CH(buf, i) || CELL_FG(buf, k) != CELL_FG(buf, i) ||
+        CELL_BG(buf, k) != CELL_BG(buf, i) || buf->widths[k] != 1)
+      break;
+
+    if (CELL_CH(&front_buffer, k) != CELL_CH(buf, i) ||
+        CELL_FG(&front_buffer, k) != CELL_FG(buf, i) ||
+        CELL_BG(&front_buffer, k) != CELL_BG(buf, i))
+      n = k - i + 1;
+  }
+
+  return n;
+}
+
+// sends n copies of a narrow char, with whichever is shortest of REP,
+// ECH (spaces only, leaves the cursor behind) or the chars themselves
+static void send_run(int x, int y, uint32_t c, int n) {
+  char buf[7];
+  int k, bw = tb_utf8_unicode_to_char(buf, c);
+
+  if ((term_caps & TERM_REP) && bw + csi_length(n - 1) < bw * n) {
+    send_char(x, y, c, 1);
+    write_csi(n - 1, 'b');
+    lastx = x + n;
+    if (lastx >= front_buffer.width)
+      lastx = LAST_COORD_INIT;
+    return;
+  }
+
+  // erased cells have no underline or reverse, and getting past them
+  // afterwards costs about as much as the ECH itself
+  if ((term_caps & TERM_ECH) && (c == ' ' || !c) &&
+      !(lastattrs & (SGR_UNDERLINE | SGR_REVERSE)) && 2 * csi_length(n) < n) {
+    if (x != lastx || y != lasty)
+      move_cursor(x, y);
+    write_csi(n, 'X');
+    lastx = x; lasty = y;
+    return;
+  }
+
+  for (k = 0; k < n; ++k)
+    send_char(x + k, y, c, 1);
 }
 
 static void sigwinch_handler(int xxx) {
@@ -789,9 +1989,8 @@ static void sigwinch_handler(int xxx) {
   unused = write(winch_fds[1], &zzz, sizeof(int));
 }
 
-static int cutesc = 0;
-#define MAXSEQ 14 // need to make room for urxvt mouse sequences
-static char seq[MAXSEQ];
+#define MAXSEQ 32 // need to make room for urxvt and sgr mouse sequences
+static char seq[MAXSEQ + 1];
 
 static int decode_char(struct tb_event * event, uint32_t ch) {
   // printf("ch: %d, meta: %d\n", ch, event->meta);
@@ -811,124 +2010,466 @@ static int decode_char(struct tb_event * event, uint32_t ch) {
   return 1;
 }
 
-static int decode_utf8(struct tb_event * event, char c) {
-  int rs, nread = 1;
-  // uint8_t len = (c >> 7 == 0) ? 1 : (c >> 5 == 0x6) ? 2 : (c >> 4 == 0xE) ? 3 : (c >> 5 == 0x1E) ? 4 : 0;
-  uint8_t len = tb_utf8_char_length(c);
+static int decode_utf8(struct tb_event * event, const char *buf, int len, bool flush) {
+  uint8_t clen = tb_utf8_char_length(buf[0]);
   uint32_t ch;
 
-  seq[0] = c;
-  while (nread < len) {
-    // if read error, or if didn't read end of sequence, return -1
-    rs = read(inout, seq + nread++, 1);
-    if (rs < 1)
-      return -1;
+  if (len < clen) {
+    if (!flush) return 0; // rest of the char is still on its way
+    event->type = 0;      // it never came, drop the broken char
+    return len;
   }
 
-  seq[nread] = '\0';
-  len = tb_utf8_char_to_unicode(&ch, seq);
+  memcpy(seq, buf, clen);
+  seq[clen] = '\0';
+  tb_utf8_char_to_unicode(&ch, seq);
   decode_char(event, ch);
-  // bytebuffer_truncate(&input_buffer, tb_utf8_char_length(seq[0]));
 
-  return len;
+  return clen;
 }
 
+// returns the length of the escape sequence at the start of buf, or 0 if
+// its final byte hasn't arrived yet
+static int esc_seq_length(const char *buf, int len) {
+  int i = 1;
+  unsigned char c;
 
-static int decode_esc(struct tb_event * event) {
-  int rs, nread = 1;
-  seq[0] = 27;
+  if (i < len && buf[i] == 27) i++; // urxvt alt + key, ^[^[[A
+  if (i >= len) return 0;
 
-  while (nread < MAXSEQ) {
-    rs = read(inout, seq + nread++, 1);
-    if (rs == -1) return -1;
-    if (rs == 0) break;
+  if (buf[i] != '[' && buf[i] != 'O')
+    return i + 1; // alt + char
 
-    // handle urxvt alt + keys
-    if (seq[nread-1] == 27) { // found another escape char!
-      if (seq[nread-2] == 27) { // double esc
-        if (read(inout, seq + nread++, 1) == 0) { // end of the road, so it's alt+esc
-          event->key  = TB_KEY_ESC;
-          event->meta = TB_META_ALT;
-          return 1;
-        } // if not end of road, then it must be ^[^[[A (urxvt alt+arrows)
-      } else {
-        cutesc = 1;
-        break;
-      }
+  if (buf[i] == '[' && i + 1 < len && buf[i+1] == 'M') // x10 mouse, 3 raw bytes
+    return i + 5 <= len ? i + 5 : 0;
+
+  if (buf[i++] == '[' && i < len && buf[i] == '[') i++; // linux f1-f5
+
+  for (; i < len; i++) {
+    c = buf[i];
+
+    if (c == '$') { // urxvt shift + key ends with '$', unless it's an intermediate
+      if (i + 1 >= len || buf[i+1] < 0x40 || buf[i+1] > 0x7e)
+        return i + 1;
+    } else if (0x40 <= c && c <= 0x7e) { // final byte
+      return i + 1;
+    } else if (c < 0x20 || c > 0x3f) { // not a parameter, so sequence is over
+      return i;
     }
   }
 
-  if (nread == MAXSEQ) return 0;
-  seq[nread] = '\0';
+  return 0;
+}
+
+static int decode_esc(struct tb_event * event, const char *buf, int len, bool flush) {
+  int end = 1, seqlen;
 
-  int mouse_parsed = parse_mouse_event(event, seq, nread-1);
-  if (mouse_parsed != 0)
-    return mouse_parsed;
+  // a sequence never spans into the next escape char, except for the double
+  // esc that urxvt sends along with alt
+  while (end < len && end < MAXSEQ) {
+    if (buf[end] == 27 && end > 1) break;
+    end++;
+  }
 
-  return parse_esc_seq(event, seq, nread-1);
-}
+  seqlen = esc_seq_length(buf, end);
+  if (seqlen == 0) {
+    if (end == len && !flush) return 0; // rest of sequence may still come
+    seqlen = end; // take what we have, like a lone esc
+  }
 
-static int read_and_extract_event(struct tb_event * event) {
-  int nread, c = 0;
+  if (seqlen == 2 && buf[1] == 27) { // double esc, alt + esc
+    event->key  = TB_KEY_ESC;
+    event->meta = TB_META_ALT;
+    return seqlen;
+  }
 
-  if (cutesc) {
-    c = 27;
-    cutesc = 0;
-  } else {
-    while ((nread = read(inout, &c, 1)) == 0);
-    if (nread == -1) return -1;
+  memcpy(seq, buf, seqlen);
+  seq[seqlen] = '\0';
+
+  int mouse_parsed = parse_mouse_event(event, seq, seqlen);
+  if (mouse_parsed != 0) {
+    if (mouse_parsed < 0) event->type = 0;
+    return seqlen;
   }
 
+  if (parse_esc_seq(event, seq, seqlen) < 0)
+    event->type = 0;
+
+  return seqlen;
+}
+
+// decodes the event at the start of buf. returns the number of bytes it
+// took, leaving event->type as zero if they were discarded, or 0 if the
+// buffer holds only part of the event so far
+static int decode_input(struct tb_event * event, const char *buf, int len, bool flush) {
+  unsigned char c = buf[0];
+
   event->type = TB_EVENT_KEY;
-  event->meta = 0;
-  event->ch   = 0;
 
   if (c == 27) { // escape
-    return decode_esc(event);
+    return decode_esc(event, buf, len, flush);
 
-  } else if (0 <= c && c <= 127) { // from ctrl-a to z, not esc
+  } else if (c <= 127) { // from ctrl-a to z, not esc
     return decode_char(event, c);
 
   } else { // utf8 sequence
-    return decode_utf8(event, c);
+    return decode_utf8(event, buf, len, flush);
+  }
+}
+
+static bool input_partial = false;
+static timestamp input_partial_ts;
+
+#define PARTIAL_SEQ_TIME 0.02 // how long to wait for the rest of a sequence
+
+// ms left until a partial sequence in the input buffer is given up on
+static int partial_remaining(void) {
+  double left = PARTIAL_SEQ_TIME - get_timediff(input_partial_ts);
+  return left > 0 ? (int)(left * 1000) + 1 : 0;
+}
+
+// pulls the next event out of the input buffer. returns 1 if one was found
+// or 0 if the buffer is empty or holds only the start of a sequence
+static int extract_event(struct tb_event * event) {
+  int n;
+  bool flush = input_partial && partial_remaining() == 0;
+
+  while (input_buffer.len > 0) {
+    memset(event, 0, sizeof(struct tb_event));
+
+    n = decode_input(event, input_buffer.buf, input_buffer.len, flush);
+    if (n == 0) {
+      if (!input_partial) {
+        input_partial = true;
+        get_time(&input_partial_ts);
+      }
+      return 0;
+    }
+
+    input_partial = false;
+    bytebuffer_truncate(&input_buffer, n);
+    if (event->type) return 1;
   }
+
+  return 0;
 }
 
-static int wait_fill_event(struct tb_event *event, struct timeval *timeout) {
+// reads everything the tty has for us in one go. returns the number of bytes
+// read, 0 if there was nothing or -1 on error or hangup
+static int fill_input_buffer(void) {
   int n;
-  fd_set events;
+
+  bytebuffer_reserve(&input_buffer, input_buffer.len + INPUT_CHUNK);
+
+  do {
+    n = read(inout, input_buffer.buf + input_buffer.len, input_buffer.cap - input_buffer.len);
+  } while (n < 0 && errno == EINTR);
+
+  if (n < 0) return errno == EAGAIN ? 0 : -1;
+  if (n == 0) return -1; // readable but empty, the tty is gone
+
+  input_buffer.len += n;
+  return n;
+}
+
+// looks for the replies to query_sync_output() in the input buffer, taking
+// them out. returns 1 once the DA1 one, which comes last, was seen
+static int take_query_replies(bool *supported) {
+  int i, j, mode;
+  char *buf = input_buffer.buf;
+
+  for (i = 0; i + 2 < input_buffer.len; i++) {
+    if (buf[i] != 27 || buf[i+1] != '[' || buf[i+2] != '?')
+      continue;
+
+    for (j = i + 3; j < input_buffer.len && (isdigit(buf[j]) || buf[j] == ';'); j++);
+    if (j >= input_buffer.len)
+      return 0; // rest of it is still on its way
+
+    if (buf[j] == 'c') { // DA1, the terminal is done answering
+      bytebuffer_erase(&input_buffer, i, j + 1 - i);
+      return 1;
+    }
+
+    // DECRPM, CSI ? 2026 ; Ps $ y. 1 and 2 mean set and reset, 0 and 4 that
+    // the mode isn't there
+    if (buf[j] == '$' && j + 1 < input_buffer.len && buf[j+1] == 'y') {
+      if (sscanf(buf + i + 3, "2026;%d", &mode) == 1)
+        *supported = mode == 1 || mode == 2;
+      bytebuffer_erase(&input_buffer, i, j + 2 - i);
+      i--;
+    }
+  }
+
+  return 0;
+}
+
+// asks the terminal about mode 2026 with DECRQM, followed by DA1, which
+// every terminal answers, so the ones that don't know DECRQM cost no wait.
+// anything else read meanwhile stays in the input buffer as input
+static bool query_sync_output(void) {
+  bool supported = false;
+  timestamp start;
+  struct timeval tv;
+  fd_set fds;
+  double left;
+  int n;
+
+  bytebuffer_puts(&output_buffer, "\033[?2026$p\033[c");
+  bytebuffer_flush(&output_buffer, inout);
+  get_time(&start);
+
+  while ((left = SYNC_QUERY_TIME - get_timediff(start)) > 0) {
+    FD_ZERO(&fds);
+    FD_SET(inout, &fds);
+    tv.tv_sec = 0;
+    tv.tv_usec = (long)(left * 1000000);
+
+    n = select(inout + 1, &fds, 0, 0, &tv);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0 || fill_input_buffer() < 0)
+      break;
+
+    if (take_query_replies(&supported))
+      return supported;
+  }
+
+  return false; // no answer, so no telling what it would do with the markers
+}
+
+// wait time for the next poll: 'timeout', unless a partial sequence is due first
+static int input_wait(int timeout) {
+  int left;
+
+  if (!input_partial) return timeout;
+
+  left = partial_remaining();
+  return (timeout < 0 || left < timeout) ? left : timeout;
+}
+
+// what's left of a timeout of 'total' ms started at 'start', -1 stays -1
+static int time_left(int total, timestamp start) {
+  int left;
+
+  if (total < 0) return total;
+  left = total - (int)(get_timediff(start) * 1000);
+  return left > 0 ? left : 0;
+}
+
+// sends more of the pending output, rendering a skipped frame once it's out
+static void output_writable(void) {
+  if (bytebuffer_flush(&output_buffer, inout) == 0 &&
+      (initflags & TB_INIT_DROP_FRAMES) && frame_skipped)
+    tb_render();
+}
+
+static int fill_resize_event(struct tb_event *event) {
+  int zzz = 0;
+  int unused __attribute__((unused));
+  unused = read(winch_fds[0], &zzz, sizeof(int));
+  buffer_size_change_request = 1;
+
+  update_term_size();
+  event->type = TB_EVENT_RESIZE;
+  event->w = termw;
+  event->h = termh;
+  return TB_EVENT_RESIZE;
+}
+
+#ifdef __linux__
+
+static int init_event_loop(void) {
+  struct epoll_event ev;
+
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd < 0)
+    return -1;
+
+  tick_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (tick_fd < 0) {
+    shutdown_event_loop();
+    return -1;
+  }
+
+  // all three are registered once, so waiting never rebuilds fd sets
+  int fds[3] = { inout, winch_fds[0], tick_fd };
+  int i;
+
+  for (i = 0; i < 3; i++) {
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = fds[i];
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fds[i], &ev) < 0) {
+      shutdown_event_loop();
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static void shutdown_event_loop(void) {
+  if (tick_fd != -1) close(tick_fd);
+  if (epoll_fd != -1) close(epoll_fd);
+  tick_fd = epoll_fd = -1;
+  epoll_out = false;
+}
+
+static int wait_fill_event(struct tb_event *event, int timeout) {
+  int i, n, result;
+  bool winch, input, tick, writable;
+  int wait;
+  struct epoll_event evs[3];
+  const int total = timeout;
+  timestamp start;
   memset(event, 0, sizeof(struct tb_event));
 
-  if (cutesc) { // there's a part of an escape sequence left!
-    n = read_and_extract_event(event);
-    if (n < 0) return -1;
-    if (n > 0) return event->type;
+  if (headless) // nothing to read from
+    return -1;
+
+  // events left in the input buffer by the last read go first
+  if (extract_event(event)) return event->type;
+
+  get_time(&start);
+  while (1) {
+    // wakeups that bring no event (output, partial input) eat into it
+    timeout = time_left(total, start);
+
+    // also watch for the tty taking more output while some is pending
+    if ((bytebuffer_pending(&output_buffer) > 0) != epoll_out) {
+      struct epoll_event ev;
+      memset(&ev, 0, sizeof(ev));
+      epoll_out = !epoll_out;
+      ev.events = EPOLLIN | (epoll_out ? EPOLLOUT : 0);
+      ev.data.fd = inout;
+      epoll_ctl(epoll_fd, EPOLL_CTL_MOD, inout, &ev);
+    }
+
+    wait = input_wait(timeout);
+    result = epoll_wait(epoll_fd, evs, 3, wait);
+    if (result < 0 && errno == EINTR) continue; // SIGWINCH, the pipe is readable now
+    if (result < 0) return -1;
+
+    if (!result) {
+      if (extract_event(event)) return event->type; // partial sequence expired
+      if (wait == timeout) return 0;
+      continue;
+    }
+
+    winch = input = tick = writable = false;
+    for (i = 0; i < result; i++) {
+      if (evs[i].data.fd == winch_fds[0]) winch = true;
+      else if (evs[i].data.fd == tick_fd) tick = true;
+      else if (evs[i].data.fd == inout) {
+        input = evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR);
+        writable = evs[i].events & EPOLLOUT;
+      }
+    }
+
+    if (writable)
+      output_writable();
+
+    if (winch)
+      return fill_resize_event(event);
+
+    if (input) {
+      n = fill_input_buffer();
+      if (n < 0) return -1;
+      if (extract_event(event)) return event->type;
+    }
+
+    if (tick) {
+      uint64_t expirations;
+      if (read(tick_fd, &expirations, sizeof(expirations)) > 0) {
+        event->type = TB_EVENT_TICK;
+        return TB_EVENT_TICK;
+      }
+    }
   }
+}
 
+#else
+
+static int init_event_loop(void) {
+  return 0;
+}
+
+static void shutdown_event_loop(void) {
+  tick_interval = 0;
+}
+
+// returns the ms left until the next tick is due
+static int tick_remaining(void) {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+
+  long ms = (tick_next.tv_sec - now.tv_sec) * 1000
+          + (tick_next.tv_usec - now.tv_usec) / 1000;
+
+  return ms > 0 ? (int)ms : 0;
+}
+
+static int wait_fill_event(struct tb_event *event, int timeout) {
+  int n, wait;
+  fd_set events, wevents;
+  struct timeval tv;
+  const int total = timeout;
+  timestamp start;
+  memset(event, 0, sizeof(struct tb_event));
+
+  if (headless) // nothing to read from
+    return -1;
+
+  // events left in the input buffer by the last read go first
+  if (extract_event(event)) return event->type;
+
+  get_time(&start);
   while (1) {
+    // wakeups that bring no event (output, partial input) eat into it
+    timeout = time_left(total, start);
+
+    wait = input_wait(timeout);
+    if (tick_interval > 0 && (wait < 0 || tick_remaining() < wait))
+      wait = tick_remaining();
+
+    tv.tv_sec = wait / 1000;
+    tv.tv_usec = (wait % 1000) * 1000;
+
     FD_ZERO(&events);
     FD_SET(inout, &events);
     FD_SET(winch_fds[0], &events);
+    FD_ZERO(&wevents);
+    if (bytebuffer_pending(&output_buffer) > 0) // the tty may take more of the pending output
+      FD_SET(inout, &wevents);
     int maxfd  = (winch_fds[0] > inout) ? winch_fds[0] : inout;
-    int result = select(maxfd+1, &events, 0, 0, timeout);
-    if (!result) return 0;
-
-    if (FD_ISSET(winch_fds[0], &events)) {
-      event->type = TB_EVENT_RESIZE;
-      int zzz = 0;
-      n = read(winch_fds[0], &zzz, sizeof(int));
-      buffer_size_change_request = 1;
-
-      update_term_size();
-      event->w = termw;
-      event->h = termh;
-      return TB_EVENT_RESIZE;
+    int result = select(maxfd+1, &events, &wevents, 0, wait < 0 ? NULL : &tv);
+    if (result < 0 && errno == EINTR) continue;
+    if (result < 0) return -1;
+
+    if (!result) {
+      if (extract_event(event)) return event->type; // partial sequence expired
+      if (tick_interval > 0 && tick_remaining() == 0) {
+        tb_set_tick(tick_interval);
+        event->type = TB_EVENT_TICK;
+        return TB_EVENT_TICK;
+      }
+      if (wait == timeout) return 0;
+      continue;
     }
 
+    if (FD_ISSET(inout, &wevents))
+      output_writable();
+
+    if (FD_ISSET(winch_fds[0], &events))
+      return fill_resize_event(event);
+
     if (FD_ISSET(inout, &events)) {
-      n = read_and_extract_event(event) > 0;
+      n = fill_input_buffer();
       if (n < 0) return -1;
-      if (n > 0) return event->type;
+      if (extract_event(event)) return event->type;
     }
   }
 }
+
+#endif
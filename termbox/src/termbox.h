@@ -122,13 +122,15 @@ struct tb_cell {
 #define TB_EVENT_KEY    1
 #define TB_EVENT_RESIZE 2
 #define TB_EVENT_MOUSE  3
+#define TB_EVENT_TICK   4
 
 /* An event, single interaction from the user. The 'mod' and 'ch' fields are
  * valid if 'type' is TB_EVENT_KEY. The 'w' and 'h' fields are valid if 'type'
  * is TB_EVENT_RESIZE. The 'x' and 'y' fields are valid if 'type' is
  * TB_EVENT_MOUSE. The 'key' field is valid if 'type' is either TB_EVENT_KEY
  * or TB_EVENT_MOUSE. The fields 'key' and 'ch' are mutually exclusive; only
- * one of them can be non-zero at a time.
+ * one of them can be non-zero at a time. TB_EVENT_TICK carries no data, see
+ * tb_set_tick().
  */
 struct tb_event {
 	uint8_t type;
@@ -150,14 +152,21 @@ struct tb_event {
 #define TB_EUNSUPPORTED_TERMINAL -1
 #define TB_EFAILED_TO_OPEN_TTY   -2
 #define TB_EPIPE_TRAP_ERROR      -3
+#define TB_EEVENT_LOOP_ERROR     -4
 
 /* Flags passed to tb_init_with() to specify which features should be enabled.
+ * TB_INIT_ALL is what tb_init() uses; the flags after it are left out and have
+ * to be asked for. TB_INIT_SYNC_OUTPUT asks the terminal whether it supports
+ * synchronized updates, which can hold tb_init_with() for a moment on
+ * terminals that don't answer.
  */
-#define TB_INIT_ALL          -1
 #define TB_INIT_ALTSCREEN     (1 << 0)
 #define TB_INIT_KEYPAD        (1 << 1)
 #define TB_INIT_NO_CURSOR     (1 << 2)
 #define TB_INIT_DETECT_MODE   (1 << 3)
+#define TB_INIT_ALL           (TB_INIT_ALTSCREEN | TB_INIT_KEYPAD | TB_INIT_NO_CURSOR | TB_INIT_DETECT_MODE)
+#define TB_INIT_SYNC_OUTPUT   (1 << 4) // frames as synchronized updates, if supported
+#define TB_INIT_DROP_FRAMES   (1 << 5) // skip frames the terminal can't keep up with, see tb_render()
 
 /* Initializes the termbox library. This function should be called before any
  * other functions. Function tb_init is same as tb_init_file("/dev/tty").
@@ -171,6 +180,13 @@ SO_IMPORT int tb_init_file(const char* name);
 SO_IMPORT int tb_init_fd(int inout);
 SO_IMPORT void tb_shutdown(void);
 
+/* Like tb_init_fd(), but for rendering into something that isn't a terminal,
+ * like a pipe or a file: the screen is w x h and stays so, the escape
+ * sequences still come from $TERM, the fd is left as it is and no events are
+ * ever delivered. Follow it with tb_init_screen(). Meant for benchmarks.
+ */
+SO_IMPORT int tb_init_headless(int fd, int w, int h);
+
 /* Returns the size of the internal back buffer (which is the same as
  * terminal's window size in characters). The internal buffer can be resized
  * after tb_resize() or tb_present() function calls. Both dimensions have an
@@ -181,17 +197,56 @@ SO_IMPORT int tb_width(void);
 SO_IMPORT int tb_height(void);
 
 /* Clears the internal back buffer using TB_DEFAULT color or the
- * color/attributes set by tb_set_clear_attributes() function.
+ * color/attributes set by tb_set_clear_attributes() function. With an upper
+ * layer selected, clears that layer back to transparent instead, touching
+ * only the cells drawn on it since its last clear.
  */
 SO_IMPORT void tb_clear_buffer(void);
 SO_IMPORT void tb_set_clear_attributes(tb_color fg, tb_color bg);
 
+/* Clears a w x h rectangle of the back buffer starting at x, y the same way,
+ * leaving the rest untouched. The rectangle is clipped to the buffer.
+ */
+SO_IMPORT void tb_clear_region(int x, int y, int w, int h);
+
 // Clear screen.
 SO_IMPORT void tb_clear_screen(void);
 
-/* Sincronize the internal back buffer with the terminal. */
+/* Sincronize the internal back buffer with the terminal. Output doesn't block:
+ * whatever the terminal doesn't take right away is kept and sent as it
+ * becomes writable, while waiting for events, unless too much of it piles up,
+ * in which case tb_render() waits for the terminal to catch up.
+ *
+ * With TB_INIT_DROP_FRAMES, which isn't part of TB_INIT_ALL and must be asked
+ * for, a render made while the previous frame is still on its way only pushes
+ * that one along; its changes go out with the next frame, in a single diff,
+ * and are rendered from the event loop if no other render comes by then.
+ */
 SO_IMPORT void tb_render(void);
 
+/* Returns the number of output bytes the terminal hasn't taken yet. */
+SO_IMPORT int tb_output_pending(void);
+
+/* Counters kept by tb_render(), see tb_get_stats(). */
+struct tb_stats {
+	uint64_t frames;         /* frames rendered */
+	uint64_t cells_compared; /* cells of dirty spans compared with the screen */
+	uint64_t cells_emitted;  /* cells sent to the terminal */
+	uint64_t cursor_jumps;   /* cursor moves to other than the next cell */
+	uint64_t sgr_switches;   /* changes of colors or attributes sent */
+	uint64_t bytes_written;  /* bytes that went out */
+	uint64_t writes;         /* write calls that took them */
+	uint64_t diff_ns;        /* time spent finding and encoding changes */
+	uint64_t flush_ns;       /* time spent writing them out */
+};
+
+/* Copies the counters of the last frame tb_render() drew to 'frame' and the
+ * totals since tb_init() to 'total', either of which may be NULL. The bytes
+ * and write calls of a frame are those tb_render() got out itself, the total
+ * counts all of them.
+ */
+SO_IMPORT void tb_get_stats(struct tb_stats *frame, struct tb_stats *total);
+
 SO_IMPORT tb_color tb_rgb(uint32_t in);
 
 /* Sets the position of the cursor. Upper-left character is (0, 0). If you pass
@@ -227,6 +282,55 @@ SO_IMPORT void tb_char(int x, int y, tb_color fg, tb_color bg, tb_chr ch);
 /* Draw empty line of N width from specific position */
 SO_IMPORT void tb_empty(int x, int y, tb_color bg, int width);
 
+/* Fill a w x h rectangle starting at x, y with the same char and colors. The
+ * rectangle is clipped to the back buffer.
+ */
+SO_IMPORT void tb_fill_rect(int x, int y, int w, int h, tb_color fg, tb_color bg, tb_chr ch);
+
+/* Draw a horizontal or vertical run of n equal cells from specific position */
+SO_IMPORT void tb_hline(int x, int y, int n, tb_color fg, tb_color bg, tb_chr ch);
+SO_IMPORT void tb_vline(int x, int y, int n, tb_color fg, tb_color bg, tb_chr ch);
+
+/* A sprite is a w x h block of cells that is copied into the back buffer as a
+ * whole by tb_blit(), one row at a time. tb_sprite_new() copies 'cells' (laid
+ * out like tb_cell_buffer()), or starts blank if it's NULL. Sprites don't
+ * depend on tb_init() and survive resizes. Returns NULL if w or h isn't
+ * positive or there isn't memory for it.
+ */
+struct tb_sprite;
+SO_IMPORT struct tb_sprite *tb_sprite_new(int w, int h, const struct tb_cell *cells);
+SO_IMPORT void tb_sprite_free(struct tb_sprite *sprite);
+
+/* Sends tb_cell(), tb_char(), the tb_string*() functions, tb_fill_rect(),
+ * tb_clear_region() and tb_blit() to a sprite instead of the back buffer, so
+ * a static picture can be drawn once with the usual calls. Pass NULL to draw
+ * to the back buffer again.
+ */
+SO_IMPORT void tb_select_sprite(struct tb_sprite *sprite);
+
+/* Number of layers available to tb_select_layer(). */
+#define TB_MAX_LAYERS 4
+
+/* Selects the layer the drawing calls write to. Layer 0 is the back buffer.
+ * Upper layers start out transparent: a cell with ch 0 lets whatever is below
+ * it show, anything else covers it. tb_render() composites the layers, only
+ * over the cells drawn on since the last render, so a static background can
+ * stay on layer 0 while the moving parts are cleared and redrawn above it.
+ * Layers are created on first use and kept until tb_shutdown(). Returns 0,
+ * or -1 if 'layer' isn't in [0, TB_MAX_LAYERS).
+ */
+SO_IMPORT int tb_select_layer(int layer);
+
+/* Copies a sprite with its top left corner at x, y, clipped to the target. */
+SO_IMPORT void tb_blit(int x, int y, const struct tb_sprite *sprite);
+
+/* Saves the whole back buffer (layer 0) into a sprite, so it can be restored later with
+ * tb_blit(0, 0, sprite). 'sprite' is reused if it's a snapshot of the same
+ * size, otherwise it's freed and a new one is returned. Pass NULL to get a
+ * fresh one. Returns NULL on failure.
+ */
+SO_IMPORT struct tb_sprite *tb_snapshot(struct tb_sprite *sprite);
+
 /* Changes cell's parameters in the internal back buffer at the specified
  * position.
  */
@@ -258,6 +362,24 @@ SO_IMPORT int tb_peek_event(struct tb_event *event, int timeout);
  */
 SO_IMPORT int tb_poll_event(struct tb_event *event);
 
+/* Waits up to 'timeout' milliseconds (forever if negative) for an event, then
+ * drains every other event that is already pending, without waiting again,
+ * into the 'events' array of 'max' entries. Returns the number of events
+ * stored, 0 if there were no event during 'timeout' period or -1 if there was
+ * an error. An error that comes after some events is returned by the next
+ * call. Use it to apply a whole burst of input before rendering a frame.
+ */
+SO_IMPORT int tb_peek_events(struct tb_event *events, int max, int timeout);
+
+/* Arms a periodic timer that makes tb_peek_event() and tb_poll_event() return
+ * a TB_EVENT_TICK event every 'interval' milliseconds, the first one
+ * 'interval' ms after the call. Passing 0 disarms it. On Linux the timer is a
+ * timerfd waited on with epoll together with the tty and the resize pipe, so
+ * an idle application without a tick armed gets no wakeups at all. Returns 0
+ * on success or -1 if there was an error.
+ */
+SO_IMPORT int tb_set_tick(int interval);
+
 SO_IMPORT void tb_resize(void);
 
 #define TB_OUTPUT_NORMAL    0